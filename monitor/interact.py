@@ -2,7 +2,7 @@
 # SPDX-License-Identifier: MIT
 # Usage: python3 -i ./interact.py
 
-import serial, time, re, struct, sys, random, socket, os
+import serial, time, re, struct, sys, random, socket, os, zlib, lzma, hashlib, bisect
 
 KiB = 1 << 10
 MiB = 1 << 20
@@ -60,6 +60,27 @@ def hexdump(data):
             print(line)
 
 
+# Read the code symbols (functions and untyped labels, as in assembly) of a
+# 32-bit little-endian ELF file, as a sorted list of (address, size, name)
+def elf_symbols(filename):
+    with open(filename, 'rb') as f:
+        elf = f.read()
+    assert elf[:4] == b'\x7fELF' and elf[4] == 1 and elf[5] == 1
+    shoff, = struct.unpack_from('<I', elf, 0x20)
+    shentsize, shnum = struct.unpack_from('<HH', elf, 0x2e)
+    sections = [struct.unpack_from('<IIIIIIIIII', elf, shoff + i * shentsize) for i in range(shnum)]
+    symbols = []
+    for sh in sections:
+        if sh[1] != 2:  # SHT_SYMTAB
+            continue
+        strtab = sections[sh[6]][4]
+        for offset in range(sh[4], sh[4] + sh[5], 16):
+            name, value, size, info, other, shndx = struct.unpack_from('<IIIBBH', elf, offset)
+            if info & 0xf in (0, 2) and name and shndx:  # STT_NOTYPE, STT_FUNC, defined
+                end = elf.index(b'\0', strtab + name)
+                symbols.append((value, size, elf[strtab + name:end].decode('UTF-8', errors='replace')))
+    return sorted(symbols)
+
 def error(s):
     sys.stderr.write(s)
     sys.stderr.write('\n')
@@ -72,7 +93,12 @@ class Lolmon:
         self.prompt = b'> '
         self.debug = 0
         self.echo_attempts = 3
-        self.chunksize = 0x38
+        self.chunksize = 0x80
+        self.frame_size = 1024
+        self.frame_attempts = 3
+        self.frame_errors = 0
+        self.binary_threshold = 64
+        self.commands = {}
 
     def connection_test(self):
         self.s.write(b'\n')
@@ -86,9 +112,8 @@ class Lolmon:
             error(f'{prefix}: {s}')
         return s
 
-    def read_until_prompt(self):
+    def read_until_prompt(self, timeout=1):
         answer = bytearray()
-        timeout = 1
         while True:
             if self.s.readable():
                 answer += self.debug_log('until prompt', self.s.read_all())
@@ -157,6 +182,86 @@ class Lolmon:
             self.flush()
             raise e
 
+    BAUD_SYNC = b'BAUD'
+    BAUD_PATTERN = bytes((i * 0x3b + 0x5a) & 0xff for i in range(64))
+
+    # Switch lolmon's console (UART0) to a different baud rate. If the
+    # handshake at the new rate fails, both sides stay at the old rate.
+    def set_baud_rate(self, baud):
+        old = self.s.baudrate
+        self.run_command_noreturn(f'baud {baud}')
+        line = self.s.read_until(b'\n')
+        if b'Switching' not in line:
+            error((line + self.read_until_prompt()[0]).decode('UTF-8', errors='replace').strip())
+            return False
+
+        # Wait for lolmon to finish sending and switch
+        time.sleep(0.01)
+        self.s.baudrate = baud
+        self.s.read_all()
+        self.s.write(self.BAUD_SYNC + self.BAUD_PATTERN)
+        if self.read_exact(len(self.BAUD_PATTERN), 1) == self.BAUD_PATTERN:
+            self.s.write(self.BAUD_SYNC)
+            answer, good = self.read_until_prompt()
+            if good:
+                return True
+
+        # lolmon goes back to the old rate after its timeouts
+        self.s.baudrate = old
+        answer, good = self.read_until_prompt(4)
+        error(f'Switching to {baud} baud failed')
+        if not good:
+            self.flush()
+        return False
+
+    # Find the highest baud rate at which binary transfers work without errors
+    def probe_baud_rate(self, addr=0x80100000, rates=[230400, 460800, 921600, 1000000, 1500000, 2000000, 3000000]):
+        best = self.s.baudrate
+        for baud in rates:
+            if baud <= best:
+                continue
+            if not self.set_baud_rate(baud):
+                break
+            data = os.urandom(16 * KiB)
+            errors = self.frame_errors
+            good = self.write_binary(addr, data) and self.read_binary(addr, len(data)) == data
+            if not good or self.frame_errors != errors:
+                self.set_baud_rate(best)
+                break
+            best = baud
+        print(f'Using {best} baud')
+        return best
+
+    # Send a whole script at once. XON/XOFF flow control keeps lolmon's input
+    # buffer from overflowing, so there's no need to wait for echoes/prompts.
+    # Don't use this for commands that transfer binary data or don't return.
+    def stream(self, script):
+        if isinstance(script, str):
+            script = script.encode('UTF-8')
+        lines = [line for line in script.splitlines() if line.strip()]
+
+        self.run_command('flow on')
+        self.s.xonxoff = True
+        try:
+            self.s.write(b'\n'.join(lines) + b'\n')
+            answer = bytearray()
+            timeout = 1
+            while answer.count(b'\r\n' + self.prompt) < len(lines):
+                data = self.debug_log('stream', self.s.read_all())
+                if data:
+                    answer += data
+                    timeout = 1
+                else:
+                    time.sleep(0.05)
+                    timeout -= 0.05
+                    if timeout < 0:
+                        error('Script timed out')
+                        break
+        finally:
+            self.s.xonxoff = False
+            self.run_command('flow off')
+        return bytes(answer)
+
     def run_command_noreturn(self, cmd):
         if self.debug:
             error(':> %s' % cmd)
@@ -165,8 +270,130 @@ class Lolmon:
         #assert self.s.read(2) == b'\r\n'
         self.s.read(2)
 
+    ACK = b'\x06'
+    NAK = b'\x15'
+    CAN = b'\x18'
+
+    def read_exact(self, n, timeout=1):
+        data = bytearray()
+        deadline = time.time() + timeout
+        while len(data) < n and time.time() < deadline:
+            data += self.s.read(n - len(data))
+        return bytes(data)
+
+    def frame_timeout(self, n, slack=0.5):
+        # time to transfer n bytes (10 bits each), plus some slack
+        return n * 10 / self.s.baudrate + slack
+
+    # slack is how long the target may take to accept a frame, beyond the transfer time
+    def send_frames(self, cmd, data, slack=0.5):
+        self.run_command_noreturn(cmd)
+        if self.read_exact(1) != self.ACK:
+            error(f'{cmd}: no response')
+            self.flush()
+            return None
+
+        pos = 0
+        while pos < len(data):
+            frame = bytes(data[pos:pos+self.frame_size])
+            for _ in range(self.frame_attempts):
+                self.s.write(struct.pack('<H', len(frame)) + frame + struct.pack('<I', zlib.crc32(frame)))
+                reply = self.read_exact(1, self.frame_timeout(len(frame) + 6, slack))
+                if reply == self.ACK:
+                    break
+                if reply == self.CAN:
+                    answer, _ = self.read_until_prompt()
+                    error(f'{cmd}: aborted: {answer.decode("UTF-8", errors="replace").strip()}')
+                    return None
+                error(f'{cmd}: frame at offset {pos:#x} not acknowledged ({reply})')
+                self.frame_errors += 1
+                if reply != self.NAK:
+                    self.flush()
+                    return None
+            else:
+                self.flush()
+                return None
+            pos += len(frame)
+
+        answer, good = self.read_until_prompt()
+        return answer if good else None
+
+    def write_binary(self, addr, data):
+        answer = self.send_frames(f'wbin {addr:x} {len(data)}', data)
+        if answer:
+            error(answer.decode('UTF-8', errors='replace'))
+        return answer is not None
+
+    @staticmethod
+    def compress_lzma(data):
+        # LZMA "alone" format with the uncompressed size filled in, like tools/lzma-compress.py
+        out = bytearray(lzma.compress(data, format=lzma.FORMAT_ALONE))
+        out[5:5+8] = struct.pack('<Q', len(data))
+        return bytes(out)
+
+    # Upload LZMA-compressed data, which is decompressed on the target while it
+    # is being received. If compressed is False, data is compressed first.
+    def write_lzma(self, addr, data, compressed=False):
+        if not compressed:
+            data = self.compress_lzma(data)
+        answer = self.send_frames(f'unlz {addr:x} {len(data)}', data)
+        if answer is None:
+            return None
+        m = re.search(rb'Decompressed ([0-9a-f]{8}) bytes', answer)
+        if not m:
+            error(answer.decode('UTF-8', errors='replace'))
+            return None
+        return int(m.group(1), 16)
+
+    # Write data to flash while it is being received. The sectors are erased
+    # without checking their contents first, which is faster for whole images.
+    # The target may wait for a block erase before accepting the next frame.
+    def write_flash_stream(self, addr, data):
+        answer = self.send_frames(f'flst {addr:x} {len(data)}', data, slack=3)
+        if answer is None:
+            return False
+        print(answer.decode('UTF-8', errors='replace').strip())
+        return self.verify(addr, data, flash=True) is not False
+
+    def read_binary(self, addr, length):
+        self.run_command_noreturn(f'rbin {addr:x} {length}')
+
+        data = bytearray()
+        attempts = 0
+        while len(data) < length:
+            header = self.read_exact(2)
+            if len(header) != 2:
+                error(f'rbin: no frame at {addr+len(data):08x}')
+                self.flush()
+                return None
+            n, = struct.unpack('<H', header)
+            frame = self.read_exact(n + 4, self.frame_timeout(n + 4))
+            if len(frame) == n + 4 and struct.unpack('<I', frame[n:])[0] == zlib.crc32(frame[:n]):
+                data += frame[:n]
+                attempts = 0
+                self.s.write(self.ACK)
+            else:
+                attempts += 1
+                self.frame_errors += 1
+                error(f'rbin: bad frame at {addr+len(data):08x}')
+                if attempts >= self.frame_attempts:
+                    self.flush()
+                    return None
+                self.s.read_all()
+                self.s.write(self.NAK)
+
+        self.read_until_prompt()
+        return bytes(data)
+
+    # Bulk transfers of RAM contents use binary frames. MMIO is left to the
+    # usual commands, which perform accesses of the right width.
+    def use_binary(self, addr, size):
+        return size >= self.binary_threshold and addr < 0xbf000000
+
     def writeX(self, cmd, size, addr, value):
         #print('poke %s %08x %s' % (cmd, addr, value))
+        if isinstance(value, (bytes, bytearray)) and size == 1 and self.use_binary(addr, len(value)):
+            return self.write_binary(addr, value)
         if isinstance(value, bytes):
             value = [x for x in value]
         if hasattr(value, '__iter__'):
@@ -188,16 +415,117 @@ class Lolmon:
     def write16(self, addr, value): return self.writeX('wh', 2, addr, value)
     def write32(self, addr, value): return self.writeX('ww', 4, addr, value)
 
-    def write_file(self, addr, filename):
+    def write_file(self, addr, filename, compress=False):
         with open(filename, 'rb') as f:
             data = f.read()
             f.close()
-            self.write8(addr, data)
+            if compress:
+                self.write_lzma(addr, data)
+            else:
+                self.write_binary(addr, data)
+            if self.verify(addr, data) is False:
+                error(f'{filename}: verification failed')
+
+    # Hash RAM or flash contents on the target. alg is 'crc' or 'sha'.
+    def hash(self, addr, size, alg='sha', flash=False):
+        answer = self.run_command(f'{"flhs" if flash else "hash"} {alg} {addr:x} {size}')
+        m = re.match(rb'([0-9a-f]+)\r\n', answer)
+        if not m:
+            error(answer.decode('UTF-8', errors='replace'))
+            return None
+        return bytes.fromhex(m.group(1).decode())
+
+    # Measure the flash read throughput with each read command and SPI0 clock
+    # (see CLK.SPI0_MUX_*), and check that the data is read correctly.
+    def flash_benchmark(self, addr=0, size=MiB, muxes=[0, 4, 7, 6, 5, 3, 2]):
+        m = re.match(rb'Read command ([0-9a-f]{2}), SPI0 clock mux (\d+)', self.run_command('flcf'))
+        old = ('fast' if m.group(1) == b'0b' else 'read', int(m.group(2)))
+        self.run_command(f'flcf read {muxes[0]}')
+        reference = self.hash(addr, size, flash=True)
+        results = {}
+        for cmd in ['read', 'fast']:
+            for mux in muxes:
+                self.run_command(f'flcf {cmd} {mux}')
+                answer = self.run_command(f'flbm {addr:x} {size}')
+                rate = float(answer.split()[0])
+                good = self.hash(addr, size, flash=True) == reference
+                print(f'{cmd} mux {mux}: {rate:8.3f} MB/s' + ('' if good else ', data corrupted'))
+                results[(cmd, mux)] = rate if good else None
+        self.run_command(f'flcf {old[0]} {old[1]}')
+        return results
+
+    # Run mbm on the target. Returns a list of (size, segment, read, write,
+    # copy, fill, latency), with the rates in MB/s and the latency in ns.
+    def memory_benchmark(self, addr=0x80100000, max_size=32 * MiB):
+        self.run_command_noreturn(f'mbm {addr:x} {max_size}')
+        answer, good = self.read_until_prompt(timeout=60)
+        results = []
+        for line in answer.decode('UTF-8', errors='replace').splitlines():
+            f = line.split()
+            if len(f) == 7 and f[1].startswith('kseg'):
+                results.append((int(f[0]), f[1], *map(float, f[2:6]), int(f[6])))
+        return results
+
+    @staticmethod
+    def plot_memory_benchmark(results):
+        import matplotlib.pyplot as plt
+        fig, (rates, latency) = plt.subplots(1, 2, figsize=(12, 5))
+        for seg in ['kseg0', 'kseg1']:
+            rows = [r for r in results if r[1] == seg]
+            sizes = [r[0] for r in rows]
+            for i, name in enumerate(['read', 'write', 'copy', 'fill']):
+                rates.plot(sizes, [r[2 + i] for r in rows], label=f'{name} ({seg})')
+            latency.plot(sizes, [r[6] for r in rows], label=seg)
+        for ax, label in [(rates, 'MB/s'), (latency, 'ns')]:
+            ax.set_xscale('log', base=2)
+            ax.set_xlabel('working set (bytes)')
+            ax.set_ylabel(label)
+            ax.legend()
+        plt.show()
+
+    # Compare RAM or flash (at a) with RAM (at b) on the target. Returns a
+    # list of (a, b, length) for the differing ranges that were shown.
+    def compare(self, a, b, size, flash=False):
+        answer = self.run_command(f'{"flcm" if flash else "cmp"} {a:x} {b:x} {size}')
+        print(answer.decode('UTF-8', errors='replace').strip())
+        return [tuple(int(x, 16) for x in m) for m in
+                re.findall(rb'^([0-9a-f]{8}) ([0-9a-f]{8}) ([0-9a-f]{8}):', answer, re.M)]
+
+    # Wait on the target until the value at addr, masked, equals value (or,
+    # with negate=True, differs from it). Returns whether that happened before
+    # the timeout, and the last value read.
+    def poll(self, addr, mask, value, timeout_ms=1000, size=4, negate=False):
+        cmd = {1: 'pb', 2: 'ph', 4: 'pw'}[size]
+        answer = self.run_command(f'{cmd} {addr:x} {mask:#x} {"!" if negate else ""}{value:#x} {timeout_ms}')
+        m = re.match(rb'(Timeout, )?([0-9a-f]{8})\r\n', answer)
+        if not m:
+            error(answer.decode('UTF-8', errors='replace'))
+            return False, None
+        return m.group(1) is None, int(m.group(2), 16)
+
+    def poll8(self, addr, mask, value, timeout_ms=1000, negate=False):  return self.poll(addr, mask, value, timeout_ms, 1, negate)
+    def poll32(self, addr, mask, value, timeout_ms=1000, negate=False): return self.poll(addr, mask, value, timeout_ms, 4, negate)
+
+    # The answer is cached until the next call, which may start another lolmon
+    def has_command(self, name):
+        if name not in self.commands:
+            self.commands[name] = not self.run_command(f'help {name}').startswith(b'Unknown command')
+        return self.commands[name]
+
+    # Check RAM or flash contents by comparing digests instead of reading them back
+    # Returns None if lolmon can't hash (boot1 build).
+    def verify(self, addr, data, flash=False):
+        if not self.has_command('flhs' if flash else 'hash'):
+            return None
+        return self.hash(addr, len(data), 'sha', flash) == hashlib.sha256(data).digest()
 
     def flash(self, memaddr, flashaddr, size):
         self.run_command("fl %08x %08x %#x" % (memaddr, flashaddr, size))
 
     def memset(self, addr, value, size):
+        if self.has_command('fb'):
+            self.run_command(f'fb {addr:x} {value:#x} {size:#x}')
+            return
         value16 = value << 8 | value
         value32 = value16 << 16 | value16
         while size > 0:
@@ -223,6 +551,13 @@ class Lolmon:
 
 
     def readX(self, cmd, size, addr, num):
+        if size != 2 and self.use_binary(addr, num * size):
+            data = self.read_binary(addr, num * size)
+            if data is not None:
+                if size == 1: return data
+                else:         return list(struct.unpack(f'<{num}I', data))
+            # rbin gave up (or lolmon doesn't have it): read as text instead
+
         output = self.run_command("%s %08x %d" % (cmd, addr, num))
         a = self.parse_r_output(output)
         if num == 1:  return a[0]
@@ -233,6 +568,46 @@ class Lolmon:
     def read16(self, addr, num=1): return self.readX('rh', 2, addr, num)
     def read32(self, addr, num=1): return self.readX('rw', 4, addr, num)
 
+    # Read num values that are stride bytes apart, in one command
+    def read_strided(self, addr, num, stride, size=4):
+        cmd = {1: 'rb', 2: 'rh', 4: 'rw'}[size]
+        if not self.has_command('rv'):
+            return self.read_vector([(addr + i * stride, size) for i in range(num)])
+        return self.parse_r_output(self.run_command(f'{cmd} {addr:x} {num} {stride:x}'))
+
+    # Batch accesses to a list of addresses into as few rv/wv commands as fit
+    # on a line, with at most 15 arguments. items are (address, size) for
+    # reads, (address, size, value) for writes.
+    def vector_lines(self, cmd, items):
+        line, size = cmd, 4
+        for item in items:
+            args = f' {item[0]:x}' + (f' {item[2]:#x}' if len(item) > 2 else '')
+            if len(line + args) > 116 or len((line + args).split()) > 15:
+                yield line
+                line, size = cmd, 4
+            if item[1] != size:
+                line += ' ' + 'bhw'[item[1] // 2]
+                size = item[1]
+            line += args
+        if line != cmd:
+            yield line
+
+    def read_vector(self, items):
+        if not self.has_command('rv'):
+            return [self.readX({1: 'rb', 2: 'rh', 4: 'rw'}[size], size, addr, 1) for addr, size in items]
+        values = []
+        for line in self.vector_lines('rv', items):
+            values += [int(x, 16) for x in self.run_command(line).decode('UTF-8').split()]
+        return values
+
+    def write_vector(self, items):
+        if not self.has_command('wv'):
+            for addr, size, value in items:
+                self.writeX({1: 'wb', 2: 'wh', 4: 'ww'}[size], size, addr, value)
+            return
+        for line in self.vector_lines('wv', items):
+            self.run_command(line)
+
     def copyX(self, cmd, dest, src, num):
         self.run_command("%s %08x %08x %d" % (cmd, src, dest, num))
 
@@ -240,16 +615,32 @@ class Lolmon:
     def copy16(self, dest, src, num): self.copyX('ch', dest, src, num)
     def copy32(self, dest, src, num): self.copyX('cw', dest, src, num)
 
-    def make_setclr(rd, wr):
+    # Replace the bits under mask with value, on the target if lolmon can do it
+    def make_modify(suffix, rd, wr):
+        def fn(self, addr, mask, value):
+            if self.has_command('mw'):
+                self.run_command(f'm{suffix} {addr:x} {mask:#x} {value & mask:#x}')
+            else:
+                wr(self, addr, rd(self, addr) & ~mask | value & mask)
+        return fn
+
+    modify8 = make_modify('b', read8, write8)
+    modify16 = make_modify('h', read16, write16)
+    modify32 = make_modify('w', read32, write32)
+
+    def make_setclr(suffix, rd, wr):
         def fn(self, addr, bit, value):
-            x = rd(self, addr)
-            if value: wr(self, addr, x |  (1 << bit))
-            else:     wr(self, addr, x & ~(1 << bit))
+            if self.has_command('mw'):
+                self.run_command(f'{"set" if value else "clr"}{suffix} {addr:x} {1 << bit:#x}')
+            else:
+                x = rd(self, addr)
+                if value: wr(self, addr, x |  (1 << bit))
+                else:     wr(self, addr, x & ~(1 << bit))
         return fn
 
-    setclr8 = make_setclr(read8, write8)
-    setclr16 = make_setclr(read16, write16)
-    setclr32 = make_setclr(read32, write32)
+    setclr8 = make_setclr('b', read8, write8)
+    setclr16 = make_setclr('h', read16, write16)
+    setclr32 = make_setclr('w', read32, write32)
 
     def make_dump(cmd):
         def fn(self, addr, length):
@@ -261,13 +652,57 @@ class Lolmon:
     dump16 = make_dump('rh')
     dump32 = make_dump('rw')
 
+    # Count two events of the CP0 performance counters while cmd runs on the
+    # target, e.g. l.perf(0, 1, 'call 80100000') for cycles and instructions
+    def perf(self, event0, event1, cmd):
+        answer = self.run_command(f'perf {event0} {event1} {cmd}')
+        m = re.search(rb'Counter 0: (\d+), counter 1: (\d+)', answer)
+        if not m:
+            error(answer.decode('UTF-8', errors='replace'))
+            return None
+        return int(m.group(1)), int(m.group(2))
+
+    # Sample the PC while cmd runs, in buckets of bucket bytes over the range
+    # from addr to addr + size. Returns {bucket address: samples}, with the
+    # samples outside of the range under None.
+    def profile(self, addr, size, bucket, cmd):
+        self.run_command(f'prof {addr:x} {size} {bucket} {cmd}')
+        hist = {}
+        for line in self.run_command('prof').decode('UTF-8').splitlines():
+            m = re.match(r'([0-9a-f]{8}|Outside): (\d+)', line)
+            if m:
+                hist[None if m.group(1) == 'Outside' else int(m.group(1), 16)] = int(m.group(2))
+        return hist
+
+    # Print the samples of a profile() per symbol of an ELF file, most first
+    @staticmethod
+    def print_profile(hist, elf):
+        symbols = elf_symbols(elf)
+        addrs = [sym[0] for sym in symbols]
+        counts = {}
+        for addr, n in hist.items():
+            name = '(outside)'
+            if addr is not None:
+                i = bisect.bisect_right(addrs, addr) - 1
+                name = symbols[i][2] if i >= 0 and addr < symbols[i][0] + max(symbols[i][1], 1) else f'{addr:08x}'
+            counts[name] = counts.get(name, 0) + n
+        total = max(sum(counts.values()), 1)
+        for name, n in sorted(counts.items(), key=lambda x: -x[1]):
+            print(f'{n:8} {n * 100 / total:5.1f}%  {name}')
+
     def call(self, addr, a=0, b=0, c=0, d=0):
+        self.commands = {}
         self.run_command_noreturn('call %x %d %d %d %d' % (addr, a, b, c, d))
 
     def call_linux_and_run_microcom(self, addr):
         self.call(addr, 0, 0xffffffff, 0)
         os.system(f'busybox microcom -s {self.s.baudrate} /dev/ttyUSB0')
 
+    def boot_partition_and_run_microcom(self, name, addr=0x81000000):
+        self.commands = {}
+        self.run_command_noreturn(f'flbt {name} {addr:x}')
+        os.system(f'busybox microcom -s {self.s.baudrate} /dev/ttyUSB0')
+
 class Block:
     def __init__(self, lolmon, base=None):
         self.l = lolmon
@@ -282,6 +717,13 @@ class Block:
     def write16(self, offset, value): return self.l.write16(self.base + offset, value)
     def write32(self, offset, value): return self.l.write32(self.base + offset, value)
 
+    def poll8(self, offset, mask, value, timeout_ms=1000, negate=False):  return self.l.poll8(self.base + offset, mask, value, timeout_ms, negate)
+    def poll32(self, offset, mask, value, timeout_ms=1000, negate=False): return self.l.poll32(self.base + offset, mask, value, timeout_ms, negate)
+
+    def modify8(self, offset, mask, value): return self.l.modify8(self.base + offset, mask, value)
+    def modify16(self, offset, mask, value): return self.l.modify16(self.base + offset, mask, value)
+    def modify32(self, offset, mask, value): return self.l.modify32(self.base + offset, mask, value)
+
     def setclr8(self, offset, bit, value): return self.l.setclr8(self.base + offset, bit, value)
     def setclr16(self, offset, bit, value): return self.l.setclr16(self.base + offset, bit, value)
     def setclr32(self, offset, bit, value): return self.l.setclr32(self.base + offset, bit, value)
@@ -361,7 +803,7 @@ class CLK(Block):
     SPI0_MUX_202M5 = 7
 
     def set_spi0_mux(self, value):
-        self.write32(self.SPI0_MUX, self.read32(self.SPI0_MUX) & ~7 | value)
+        self.modify32(self.SPI0_MUX, 7, value)
 
     def rate_slow(self):
         if self.read32(self.REG20) & self.REG20_SLOW_MUX:
@@ -371,6 +813,8 @@ class CLK(Block):
 
 
 class SPI(Block):
+    BASES = [0xbf010000, 0xbf159000]
+    BUF = 0x80100000
     TRXFIFO = 0x0
     TRXLEN = 0x120
     CONTROL = 0x124
@@ -419,10 +863,30 @@ class SPI(Block):
     def can_rx(self):
         return (self.read32(self.STATUS) & self.STATUS_RXLVL_MASK) != 0
 
+    # Run a whole transaction with the spi command, if lolmon has it. Data
+    # that doesn't fit on the command line goes through BUF.
+    def transfer(self, cmd, tx=b'', rxlen=0):
+        line = f'spi {self.BASES.index(self.base)} ' + ' '.join(f'{b:x}' for b in cmd)
+        if len(tx):
+            self.l.write8(self.BUF, bytes(tx))
+            line += f' wr {self.BUF:x} {len(tx)}'
+        elif rxlen > 16:
+            line += f' rd {rxlen} {self.BUF:x}'
+        elif rxlen:
+            line += f' rd {rxlen}'
+        answer = self.l.run_command(line).decode('UTF-8', errors='replace').strip()
+        if rxlen > 16:
+            return self.l.read8(self.BUF, rxlen)
+        if rxlen:
+            return bytes.fromhex(answer.splitlines()[0])
+
     def do_transfer(self, cmd, tx, rxlen):
         assert len(tx) == 0 or rxlen == 0
         assert len(cmd) < 0x20
 
+        if self.l.has_command('spi'):
+            return self.transfer(cmd, tx, rxlen)
+
         control = len(cmd) << 16
         if len(tx):
             control |= self.CONTROL_TX
@@ -443,7 +907,10 @@ class SPI(Block):
         if rxlen:
             rx = []
             for i in range(0, rxlen, 4):
-                while not self.can_rx(): pass
+                done, _ = self.poll32(self.STATUS, self.STATUS_RXLVL_MASK, 0, negate=True)
+                if not done:
+                    error(f'SPI: no data received after {len(rx)} of {rxlen} bytes')
+                    return None
                 rx += to_le32(self.read32(self.TRXFIFO))
             return rx[0:rxlen]
 
@@ -466,7 +933,8 @@ class SPI(Block):
         PART_BASE = 0x10000
         PART_BUF = 0x80100000
         CODE_BUF = 0x80200000
-        self.l.run_command(f'flrd {PART_BASE:x} {PART_BUF:x} {BLOCK_SIZE:x}')
+        shadow = self.l.has_command('shwr')
+        self.l.run_command(f'{"shrd" if shadow else "flrd"} {PART_BASE:x} {PART_BUF:x} {BLOCK_SIZE:x}')
         assert self.l.read8(PART_BUF, 12) == PART_MAGIC
         assert self.l.read8(PART_BUF + 0x94, 8) == b'demo\0\0\0\0'
         if self.l.read8(PART_BUF + 0x88, 4) != b'NCRC':
@@ -480,10 +948,29 @@ class SPI(Block):
 
         # Send and write file
         self.l.write8(CODE_BUF, data)
-        self.l.run_command(f'flwr {CODE_BUF:x} {offset:x} {len(data)}')
+        if shadow:
+            # Stage both changes in the flash shadow, but write the file first
+            self.l.run_command(f'shwr {CODE_BUF:x} {offset:x} {len(data)}')
+            self.l.run_command(f'shwr {PART_BUF:x} {PART_BASE:x} {BLOCK_SIZE:x}')
+            self.l.run_command(f'shcm {offset:x} {len(data)}')
+        else:
+            self.l.run_command(f'flwr {CODE_BUF:x} {offset:x} {len(data)}')
+        ok = self.l.verify(offset, data, flash=True)
+        if ok is None:
+            # No flhs (boot1): read the file back instead
+            self.l.run_command(f'flrd {offset:x} {CODE_BUF:x} {len(data)}')
+            ok = self.l.read8(CODE_BUF, len(data)) == data
+        if not ok:
+            error('Verification failed, not updating the partition table')
+            if shadow:
+                self.l.run_command('shst drop')
+            return
 
         # Commit partition table
-        self.l.run_command(f'flwr {PART_BUF:x} {PART_BASE:x} {BLOCK_SIZE:x}')
+        if shadow:
+            self.l.run_command('shcm')
+        else:
+            self.l.run_command(f'flwr {PART_BUF:x} {PART_BASE:x} {BLOCK_SIZE:x}')
 
     def flash_write_and_verify(self, fladdr, data):
         WRITE_BUF = 0x80100000
@@ -495,6 +982,8 @@ class SPI(Block):
             chunk = data[i:i+step]
             self.l.write8(WRITE_BUF, chunk)
             self.l.run_command(f'flwr {WRITE_BUF:x} {fladdr+i:x} {len(chunk)}')
+            if self.l.verify(fladdr+i, chunk, flash=True):
+                continue
             self.l.run_command(f'flrd {fladdr+i:x} {READ_BUF:x} {len(chunk)}')
             readback = self.l.read8(READ_BUF, len(chunk))
             if readback != chunk:
@@ -686,6 +1175,7 @@ class GPIOWrap:
         return self.g[offset // 64].get(offset % 64)
 
 class I2C(Block):
+    BASES = [0xbf560000, 0xbf570000, 0xbf158000, 0xbf15c000, 0xbf580000]
     STATUS = 0x04
     WRITE = 0x08
     READ = 0x0c
@@ -698,13 +1188,28 @@ class I2C(Block):
     CONTROL_START = 0x80
 
     def finish(self):
-        while self.read8(self.CONTROL) != self.CONTROL_DONE:
-            print(hex(self.read8(self.CONTROL)))
+        done, control = self.poll8(self.CONTROL, 0xff, self.CONTROL_DONE)
+        if not done:
+            print(f'I2C control: {control:02x}')
 
         status = self.read8(self.STATUS)
         if status & 0xa0:
             print(f'I2C status: {status:02x}')
 
+    # Run a whole transaction on the target: write the bytes to the 7-bit
+    # address addr, then read count bytes. Returns the bytes read, or None on
+    # error.
+    def transfer(self, addr, write=b'', read=0):
+        cmd = f'i2c {self.BASES.index(self.base)} {addr:x} ' + ' '.join(f'{b:x}' for b in write)
+        if read:
+            cmd += f' rd {read}'
+        answer = self.l.run_command(cmd).decode('UTF-8', errors='replace')
+        lines = answer.strip().splitlines()
+        if not lines or not lines[-1].startswith('status '):
+            print(f'I2C: {answer.strip()}')
+            return None
+        return bytes.fromhex(lines[0]) if read else b''
+
     def write(self, value, start):
         control = self.CONTROL_WRITE
         if start:
@@ -733,6 +1238,9 @@ class Frontpanel:
         self.i2c = i2c
 
     def run_command(self, cmd):
+        if self.i2c.l.has_command('i2c'):
+            self.i2c.transfer(cmd >> 8 & 0x1f | 0x20, [cmd & 0xff])
+            return
         self.i2c.write((cmd >> 7) & 0x3e | 0x40, 1)
         self.i2c.write(cmd & 0xff, 0)
         self.i2c.stop()
@@ -763,6 +1271,10 @@ class Frontpanel:
     # - Power: 0x17
     # - Add 0x40 while key is pressed
     def get_keys(self):
+        if self.i2c.l.has_command('i2c'):
+            keys = self.i2c.transfer(0x20 | 7, read=1)
+            if keys:
+                return keys[0]
         self.i2c.write(0x40 | 7 << 1 | 1, 1)
         keys = self.i2c.read(1)
         self.i2c.stop()
@@ -787,13 +1299,21 @@ class UART(Block):
         return div, frac, 1 - int((rem * 2) < baud)
 
     def set_baud_rate(self, baud):
+        if self == uart0 and self.l.has_command('baud'):
+            # lolmon's console: negotiate the switch
+            return self.l.set_baud_rate(baud)
+
         div, frac, _ = self.calc_baud_divisors(baud)
         assert div < 256
         assert frac < 16
+        if self != uart0:
+            self.write32(self.BAUD_DIV, [div, frac])
+            return
+
+        # lolmon without the baud command (boot1): switch without a handshake
         self.l.run_command_noreturn(f'ww {self.base + self.BAUD_DIV:08x} {div} {frac}')
-        if self == uart0:
-            self.l.s.baudrate = baud
-            self.l.connection_test()
+        self.l.s.baudrate = baud
+        self.l.connection_test()
 
 
 l = Lolmon('/dev/ttyUSB0')
@@ -819,5 +1339,6 @@ serprog = Serprog(spi0)
 spi0.init()
 
 def scan_mem():
-    for i in range(0x80000000, 0x80000000 + 64 * MiB, 0x8000):
-        print(f'{i:x}:  ' + ' '.join([f'{l.read32(i+o*0x1000):08x}' for o in range(8)]))
+    values = l.read_strided(0x80000000, 64 * MiB // 0x1000, 0x1000)
+    for i in range(0, len(values), 8):
+        print(f'{0x80000000 + i * 0x1000:x}:  ' + ' '.join([f'{v:08x}' for v in values[i:i+8]]))
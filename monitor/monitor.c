@@ -12,6 +12,28 @@
 #define MiB (1 << 20)
 #define GiB (1 << 30)
 
+/*
+ * BOOT1 is defined when lolmon is built as a boot1 image. It then runs from a
+ * small SRAM, before DRAM is initialized, so the features that need DRAM
+ * buffers, and those that aren't needed to get code into RAM or flash, are
+ * left out.
+ */
+
+/*
+ * DRAM for buffers that don't fit next to lolmon. Keep uploads below
+ * SCRATCH_LOW. 0x83e00000-0x83f00000 is left free for AV CPU images (see
+ * tools/pack-avcpu.py). The stack grows down from SCRATCH_FRAMES, which
+ * start.S hardcodes, and has 64 KiB before it reaches the AV CPU images.
+ */
+#define SCRATCH_LOW	0x83a00000
+#define SCRATCH_SHADOW	0x83a00000	/* copy of the flash, 4 MiB */
+#define SCRATCH_BASE	0x83f00000
+#define SCRATCH_STACK	(SCRATCH_BASE + 0x00000)	/* stack, 64 KiB */
+#define SCRATCH_FRAMES	(SCRATCH_BASE + 0x10000)	/* ring of frame buffers */
+#define SCRATCH_LZMA	(SCRATCH_BASE + 0x30000)	/* LZMA probability model */
+#define SCRATCH_TRACE	(SCRATCH_BASE + 0x80000)	/* durations of script lines */
+#define SCRATCH_PROFILE	(SCRATCH_BASE + 0x90000)	/* profiler histogram, 256 KiB */
+
 /* MMIO accessors */
 
 static uint8_t  read8(unsigned long addr)  { return *(volatile uint8_t *)addr; }
@@ -22,34 +44,136 @@ static void write8(unsigned long addr, uint8_t value)   { *(volatile uint8_t *)a
 static void write16(unsigned long addr, uint16_t value) { *(volatile uint16_t *)addr = value; }
 static void write32(unsigned long addr, uint32_t value) { *(volatile uint32_t *)addr = value; }
 
+/* Accesses above this address go to hardware registers, and must be done exactly as requested */
+#define MMIO_BASE	0xbf000000
+
+#define CACHE_LINE 32
+#define CACHE_LINE_MASK (CACHE_LINE - 1)
+
+/* Cache hints for the PREF instruction */
+#define PREF_LOAD		0
+#define PREF_PREPARE_FOR_STORE	30	/* allocate a cache line without reading it; it must be overwritten completely */
+
+#define pref(hint, addr) __asm__ volatile("pref %0, 0(%1)" :: "i"(hint), "r"(addr))
+
+/* Coprocessor 0 registers */
+#define mfc0(reg, sel) ({ uint32_t __value; \
+	__asm__ volatile("mfc0 %0, $" #reg ", " #sel : "=r"(__value)); __value; })
+#define mtc0(reg, sel, value) \
+	__asm__ volatile("mtc0 %0, $" #reg ", " #sel "; ehb" :: "r"((uint32_t)(value)))
+
 
 /* UART driver */
 
 #define UART_BASE 0xbf540000
+#define UART_BAUD_DIV	(UART_BASE + 0x18)
+#define UART_BAUD_FRAC	(UART_BASE + 0x1c)
 #define UART_FIFO_MAX 64
 
+/*
+ * Received characters are moved from the 64-byte FIFO into a ring buffer
+ * whenever lolmon waits for the UART, and between the steps of long commands,
+ * so that input isn't lost while a command is running.
+ */
+#define UART_RING_SIZE	1024	/* must be a power of two */
+#define UART_RING_HIGH	(UART_RING_SIZE - 256)
+#define UART_RING_LOW	(UART_RING_SIZE / 4)
+
+#define XON  0x11
+#define XOFF 0x13
+
+static uint8_t uart_ring[UART_RING_SIZE];
+static uint32_t uart_ring_head, uart_ring_tail;
+static uint32_t uart_dropped;
+
+/* XON/XOFF flow control, so the host can send input without waiting for echoes */
+static bool uart_flow_enabled, uart_flow_paused, uart_flow_stopped;
+
 static int uart_tx_level(void)
 {
 	return read16(UART_BASE + 0x10);
 }
 
-static int uart_rx_level(void)
+static int uart_fifo_rx_level(void)
 {
 	return read16(UART_BASE + 0x14);
 }
 
-static void uart_tx(char ch)
+static void uart_flow_send(bool stop)
 {
+	if (!uart_flow_enabled || uart_flow_paused || uart_flow_stopped == stop)
+		return;
+
+	uart_flow_stopped = stop;
 	while (uart_tx_level() >= UART_FIFO_MAX)
 		;
+	write16(UART_BASE + 0x100, stop? XOFF : XON);
+}
+
+/* Binary transfers pace themselves and must not contain flow control characters */
+static void uart_flow_pause(bool pause)
+{
+	if (pause)
+		uart_flow_send(false);
+	uart_flow_paused = pause;
+}
+
+/* Move received characters from the FIFO into the ring buffer */
+static void uart_poll(void)
+{
+	while (uart_fifo_rx_level() != 0) {
+		uint8_t c = read16(UART_BASE + 0x200);
+
+		if (uart_ring_head - uart_ring_tail < UART_RING_SIZE)
+			uart_ring[uart_ring_head++ % UART_RING_SIZE] = c;
+		else
+			uart_dropped++;
+	}
+
+	if (uart_ring_head - uart_ring_tail >= UART_RING_HIGH)
+		uart_flow_send(true);
+}
+
+static int uart_rx_level(void)
+{
+	uart_poll();
+	return uart_ring_head - uart_ring_tail;
+}
+
+#ifndef BOOT1
+/* Check whether Ctrl-C has been received, and if so, drop the input up to it */
+static bool uart_interrupted(void)
+{
+	uart_poll();
+	for (uint32_t i = uart_ring_tail; i != uart_ring_head; i++) {
+		if (uart_ring[i % UART_RING_SIZE] == 0x03) {
+			uart_ring_tail = i + 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+#endif
+
+static void uart_tx(char ch)
+{
+	while (uart_tx_level() >= UART_FIFO_MAX)
+		uart_poll();
 	write16(UART_BASE + 0x100, ch);
 }
 
 static char uart_rx(void)
 {
 	while (uart_rx_level() == 0)
-		;
-	return read16(UART_BASE + 0x200);
+		uart_flow_send(false);
+
+	char c = uart_ring[uart_ring_tail++ % UART_RING_SIZE];
+
+	if (uart_ring_head - uart_ring_tail <= UART_RING_LOW)
+		uart_flow_send(false);
+
+	return c;
 }
 
 
@@ -135,12 +259,39 @@ static void put_hex32(uint32_t x)
 	put_hex16(x & 65535);
 }
 
+/* Print a 32-bit number in decimal. */
+static void put_dec(uint32_t x)
+{
+	char buf[11];
+	int i = sizeof(buf) - 1;
+
+	buf[i] = 0;
+	do {
+		buf[--i] = '0' + x % 10;
+		x /= 10;
+	} while (x);
+
+	putstr(&buf[i]);
+}
+
 /* Get a character from the UART */
 static int getchar(void)
 {
 	return uart_rx();
 }
 
+/* Get a character from the UART, or -1 if none arrives in time */
+static int getchar_timeout(uint32_t ms)
+{
+	uint32_t start = timer_get();
+
+	while (uart_rx_level() == 0)
+		if (check_timeout(start, ms))
+			return -1;
+
+	return (uint8_t)uart_rx();
+}
+
 
 /* String functions */
 
@@ -156,9 +307,11 @@ static size_t strlen(const char *s)
 
 static int strncmp(const char *a, const char *b, size_t n)
 {
-	for (size_t i = 0; i < n && a[i] && b[i]; i++) {
+	for (size_t i = 0; i < n; i++) {
 		if (a[i] != b[i])
 			return (int)a[i] - (int)b[i];
+		if (!a[i])
+			break;
 	}
 
 	return 0;
@@ -175,114 +328,683 @@ static void *memcpy(void *d, const void *s, size_t n)
 	return d;
 }
 
-/* Parse a number, similar to strtol. base 0 means auto-detect */
-static bool parse_int(const char *s, uint32_t base, uint32_t *result)
+static void *memset(void *s, int c, size_t n)
+{
+	uint8_t *p = s;
+
+	for (size_t i = 0; i < n; i++)
+		*p++ = c;
+
+	return s;
+}
+
+/* CRC-32 as used by zlib, computed nibble-wise to keep the table small */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+	static const uint32_t table[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+	};
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc ^= data[i];
+		crc = (crc >> 4) ^ table[crc & 15];
+		crc = (crc >> 4) ^ table[crc & 15];
+	}
+
+	return ~crc;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#ifndef BOOT1
+/* SHA-256, to check larger amounts of data */
+
+struct sha256 {
+	uint32_t state[8];
+	uint8_t block[64];
+	uint32_t count;
+};
+
+static uint32_t ror32(uint32_t x, int n)
+{
+	return x >> n | x << (32 - n);
+}
+
+static void sha256_init(struct sha256 *sha)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(sha->state, init, sizeof(init));
+	sha->count = 0;
+}
+
+static void sha256_block(struct sha256 *sha)
+{
+	static const uint32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+	uint32_t w[64], v[8], t1, t2;
+
+	for (int i = 0; i < 16; i++) {
+		const uint8_t *p = &sha->block[i * 4];
+		w[i] = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	}
+	for (int i = 16; i < 64; i++)
+		w[i] = w[i-16] + w[i-7] +
+			(ror32(w[i-15], 7) ^ ror32(w[i-15], 18) ^ (w[i-15] >> 3)) +
+			(ror32(w[i-2], 17) ^ ror32(w[i-2], 19) ^ (w[i-2] >> 10));
+
+	memcpy(v, sha->state, sizeof(v));
+	for (int i = 0; i < 64; i++) {
+		t1 = v[7] + (ror32(v[4], 6) ^ ror32(v[4], 11) ^ ror32(v[4], 25)) +
+			((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i];
+		t2 = (ror32(v[0], 2) ^ ror32(v[0], 13) ^ ror32(v[0], 22)) +
+			((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		for (int j = 7; j > 0; j--)
+			v[j] = v[j-1];
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+
+	for (int i = 0; i < 8; i++)
+		sha->state[i] += v[i];
+}
+
+static void sha256_update(struct sha256 *sha, const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		sha->block[sha->count++ % 64] = data[i];
+		if (sha->count % 64 == 0)
+			sha256_block(sha);
+	}
+}
+
+static void sha256_final(struct sha256 *sha, uint8_t *digest)
+{
+	uint32_t count = sha->count;
+	uint8_t pad = 0x80, length[8] = {
+		0, 0, 0, count >> 29, count >> 21, count >> 13, count >> 5, count << 3
+	};
+
+	sha256_update(sha, &pad, 1);
+	pad = 0;
+	while (sha->count % 64 != 56)
+		sha256_update(sha, &pad, 1);
+	sha256_update(sha, length, sizeof(length));
+
+	for (int i = 0; i < 32; i++)
+		digest[i] = sha->state[i / 4] >> (24 - i % 4 * 8);
+}
+#endif /* BOOT1 */
+
+/* Parse the digits of a number, up to the first character that doesn't fit. base 0 means auto-detect */
+static uint32_t parse_digits(const char **p, uint32_t base)
 {
 	uint32_t x = 0, digit;
-	const char *p = s;
+	const char *s = *p;
 
 	if (base == 0) {
 		if (s[0] == '0' && s[1] == 'x') {
 			base = 16;
-			p += 2;
+			s += 2;
 		} else {
 			base = 10;
 		}
 	}
 
-	for (; *p; p++) {
-		if (*p >= '0' && *p <= '9') {
-			digit = *p - '0';
-		} else if (*p >= 'a' && *p <= 'z') {
-			digit = *p - 'a' + 10;
-		} else if (*p >= 'A' && *p <= 'Z') {
-			digit = *p - 'A' + 10;
-		} else {
-			putstr("Invalid number ");
-			puts(s);
-			return false;
-		}
+	for (; *s; s++) {
+		if (*s >= '0' && *s <= '9')
+			digit = *s - '0';
+		else if (*s >= 'a' && *s <= 'z')
+			digit = *s - 'a' + 10;
+		else if (*s >= 'A' && *s <= 'Z')
+			digit = *s - 'A' + 10;
+		else
+			break;
 
-		if (digit >= base) {
-			putstr("Invalid number ");
-			puts(s);
-			return false;
-		}
+		if (digit >= base)
+			break;
 
 		x *= base;
 		x += digit;
 	}
 
+	*p = s;
+	return x;
+}
+
+#ifndef BOOT1
+/*
+ * Expressions in numeric arguments: C operators with C precedence, variables
+ * ($a to $z), and parentheses, without spaces. Numbers are read in the base
+ * of the argument, so "$p+10" is 0x10 bytes after $p in an address.
+ */
+static uint32_t vars[26];
+static bool expr_error;
+
+static const char expr_ops[][3] = {
+	/* Two-character operators first, so that "<" doesn't match "<<" */
+	"<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+	"*", "/", "%", "+", "-", "<", ">", "&", "^", "|",
+};
+
+static int expr_prec(const char *op)
+{
+	switch (op[0]) {
+	case '*': case '/': case '%': return 10;
+	case '+': case '-': return 9;
+	case '<': case '>': return op[1] == op[0]? 8 : 7;
+	case '=': case '!': return 6;
+	case '&': return op[1]? 2 : 5;
+	case '^': return 4;
+	default: return op[1]? 1 : 3;	/* | and || */
+	}
+}
+
+static uint32_t expr_apply(const char *op, uint32_t x, uint32_t y)
+{
+	if ((op[0] == '/' || op[0] == '%') && y == 0) {
+		expr_error = true;
+		return 0;
+	}
+
+	switch (op[0]) {
+	case '*': return x * y;
+	case '/': return x / y;
+	case '%': return x % y;
+	case '+': return x + y;
+	case '-': return x - y;
+	case '<': return op[1] == '<'? x << y : op[1] == '='? x <= y : x < y;
+	case '>': return op[1] == '>'? x >> y : op[1] == '='? x >= y : x > y;
+	case '=': return x == y;
+	case '!': return x != y;
+	case '&': return op[1]? x && y : x & y;
+	case '^': return x ^ y;
+	default:  return op[1]? x || y : x | y;
+	}
+}
+
+static uint32_t expr_binary(const char **p, uint32_t base, int min_prec);
+
+static uint32_t expr_primary(const char **p, uint32_t base)
+{
+	const char *s = *p;
+	uint32_t x;
+
+	switch (*s) {
+	case '(':
+		*p = s + 1;
+		x = expr_binary(p, base, 1);
+		if (**p == ')')
+			(*p)++;
+		else
+			expr_error = true;
+		return x;
+	case '-':
+		*p = s + 1;
+		return -expr_primary(p, base);
+	case '~':
+		*p = s + 1;
+		return ~expr_primary(p, base);
+	case '!':
+		*p = s + 1;
+		return !expr_primary(p, base);
+	case '$':
+		if (s[1] < 'a' || s[1] > 'z') {
+			expr_error = true;
+			return 0;
+		}
+		*p = s + 2;
+		return vars[s[1] - 'a'];
+	default:
+		x = parse_digits(p, base);
+		if (*p == s)
+			expr_error = true;
+		return x;
+	}
+}
+
+/* Precedence climbing: Parse operators that bind at least as tightly as min_prec */
+static uint32_t expr_binary(const char **p, uint32_t base, int min_prec)
+{
+	uint32_t x = expr_primary(p, base);
+
+	while (!expr_error) {
+		const char *op = NULL;
+		int prec;
+
+		for (size_t i = 0; i < ARRAY_LENGTH(expr_ops); i++) {
+			if (!strncmp(*p, expr_ops[i], strlen(expr_ops[i]))) {
+				op = expr_ops[i];
+				break;
+			}
+		}
+		if (!op || (prec = expr_prec(op)) < min_prec)
+			break;
+
+		*p += strlen(op);
+		x = expr_apply(op, x, expr_binary(p, base, prec + 1));
+	}
+
+	return x;
+}
+#endif /* BOOT1 */
+
+/* Parse a number, similar to strtol. base 0 means auto-detect */
+static bool parse_int(const char *s, uint32_t base, uint32_t *result)
+{
+	const char *p = s;
+	uint32_t x;
+
+#ifdef BOOT1
+	x = parse_digits(&p, base);
+#else
+	expr_error = false;
+	x = expr_binary(&p, base, 1);
+	if (expr_error)
+		p = s;
+#endif
+
+	if (*p) {
+		putstr("Invalid number ");
+		puts(s);
+		return false;
+	}
+
 	*result = x;
 	return true;
 }
 
 
+#ifndef BOOT1
+
+/* LZMA decoder, for the "alone" format produced by tools/lzma-compress.py */
+
+#define LZMA_STATES		12
+#define LZMA_POS_BITS_MAX	4
+#define LZMA_LC_LP_MAX		4
+#define LZMA_END_POS_MODEL	14
+#define LZMA_FULL_DISTANCES	128
+#define LZMA_ALIGN_BITS		4
+#define LZMA_MATCH_MIN		2
+
+struct lzma_len_probs {
+	uint16_t choice, choice2;
+	uint16_t low[1 << LZMA_POS_BITS_MAX][1 << 3];
+	uint16_t mid[1 << LZMA_POS_BITS_MAX][1 << 3];
+	uint16_t high[1 << 8];
+};
+
+struct lzma_probs {
+	uint16_t is_match[LZMA_STATES << LZMA_POS_BITS_MAX];
+	uint16_t is_rep[LZMA_STATES];
+	uint16_t is_rep_g0[LZMA_STATES];
+	uint16_t is_rep_g1[LZMA_STATES];
+	uint16_t is_rep_g2[LZMA_STATES];
+	uint16_t is_rep0_long[LZMA_STATES << LZMA_POS_BITS_MAX];
+	uint16_t pos_slot[4][1 << 6];
+	uint16_t pos_special[1 + LZMA_FULL_DISTANCES - LZMA_END_POS_MODEL];
+	uint16_t align[1 << LZMA_ALIGN_BITS];
+	struct lzma_len_probs len, rep_len;
+	uint16_t literal[0x300 << LZMA_LC_LP_MAX];
+};
+
+struct lzma {
+	/* Input function, returns -1 on error */
+	int (*getc)(void *arg);
+	void *arg;
+
+	uint32_t range, code;
+	bool error;
+	struct lzma_probs *probs;
+};
+
+static uint8_t lzma_getc(struct lzma *lz)
+{
+	int c = lz->getc(lz->arg);
+
+	if (c < 0) {
+		lz->error = true;
+		return 0;
+	}
+
+	return c;
+}
+
+static unsigned rc_bit(struct lzma *lz, uint16_t *prob)
+{
+	uint32_t bound = (lz->range >> 11) * *prob;
+	unsigned bit;
+
+	if (lz->code < bound) {
+		*prob += ((1 << 11) - *prob) >> 5;
+		lz->range = bound;
+		bit = 0;
+	} else {
+		*prob -= *prob >> 5;
+		lz->code -= bound;
+		lz->range -= bound;
+		bit = 1;
+	}
+
+	if (lz->range < (1 << 24)) {
+		lz->range <<= 8;
+		lz->code = lz->code << 8 | lzma_getc(lz);
+	}
+
+	return bit;
+}
+
+static uint32_t rc_direct(struct lzma *lz, int bits)
+{
+	uint32_t result = 0;
+
+	while (bits--) {
+		lz->range >>= 1;
+		lz->code -= lz->range;
+		uint32_t t = 0 - (lz->code >> 31);
+		lz->code += lz->range & t;
+		result = (result << 1) + (t + 1);
+
+		if (lz->range < (1 << 24)) {
+			lz->range <<= 8;
+			lz->code = lz->code << 8 | lzma_getc(lz);
+		}
+	}
+
+	return result;
+}
+
+static unsigned rc_tree(struct lzma *lz, uint16_t *probs, int bits)
+{
+	unsigned m = 1;
+
+	for (int i = 0; i < bits; i++)
+		m = (m << 1) + rc_bit(lz, &probs[m]);
+
+	return m - (1 << bits);
+}
+
+static unsigned rc_tree_reverse(struct lzma *lz, uint16_t *probs, int bits)
+{
+	unsigned m = 1, symbol = 0;
+
+	for (int i = 0; i < bits; i++) {
+		unsigned bit = rc_bit(lz, &probs[m]);
+		m = (m << 1) + bit;
+		symbol |= bit << i;
+	}
+
+	return symbol;
+}
+
+static unsigned lzma_len(struct lzma *lz, struct lzma_len_probs *p, unsigned pos_state)
+{
+	if (!rc_bit(lz, &p->choice))
+		return rc_tree(lz, p->low[pos_state], 3);
+	if (!rc_bit(lz, &p->choice2))
+		return 8 + rc_tree(lz, p->mid[pos_state], 3);
+	return 16 + rc_tree(lz, p->high, 8);
+}
+
+static uint32_t lzma_dist(struct lzma *lz, unsigned len)
+{
+	struct lzma_probs *p = lz->probs;
+	unsigned slot = rc_tree(lz, p->pos_slot[min(len, 3)], 6);
+
+	if (slot < 4)
+		return slot;
+
+	int bits = (slot >> 1) - 1;
+	uint32_t dist = (2 | (slot & 1)) << bits;
+
+	if (slot < LZMA_END_POS_MODEL) {
+		dist += rc_tree_reverse(lz, p->pos_special + dist - slot, bits);
+	} else {
+		dist += rc_direct(lz, bits - LZMA_ALIGN_BITS) << LZMA_ALIGN_BITS;
+		dist += rc_tree_reverse(lz, p->align, LZMA_ALIGN_BITS);
+	}
+
+	return dist;
+}
+
+/*
+ * Decode an LZMA stream into out, which also serves as the dictionary. At most
+ * max bytes are written. Returns the number of decoded bytes, or -1 on error.
+ */
+static long lzma_decode(struct lzma *lz, uint8_t *out, uint32_t max)
+{
+	uint8_t header[13];
+	uint32_t size, pos = 0, rep0 = 0, rep1 = 0, rep2 = 0, rep3 = 0;
+	unsigned state = 0;
+
+	for (size_t i = 0; i < sizeof(header); i++)
+		header[i] = lzma_getc(lz);
+
+	unsigned props = header[0];
+	if (lz->error || props >= 9 * 5 * 5)
+		return -1;
+
+	unsigned lc = props % 9, lp = props / 9 % 5, pb = props / 45;
+	if (lc + lp > LZMA_LC_LP_MAX)
+		return -1;
+
+	/* The size is unknown if all bits are set; the stream has an end marker then */
+	size = get_le32(header + 5);
+	if (get_le32(header + 9) == ~0u && size == ~0u)
+		size = max;
+	else if (get_le32(header + 9) != 0 || size > max)
+		return -1;
+
+	uint16_t *probs = (void *)lz->probs;
+	for (size_t i = 0; i < sizeof(struct lzma_probs) / sizeof(uint16_t); i++)
+		probs[i] = 1 << 10;
+
+	lz->range = ~0u;
+	lz->code = 0;
+	for (int i = 0; i < 5; i++)
+		lz->code = lz->code << 8 | lzma_getc(lz);
+
+	while (pos < size && !lz->error) {
+		struct lzma_probs *p = lz->probs;
+		unsigned pos_state = pos & ((1 << pb) - 1);
+		unsigned len;
+
+		if (!rc_bit(lz, &p->is_match[state << LZMA_POS_BITS_MAX | pos_state])) {
+			/* Literal */
+			unsigned prev = pos ? out[pos - 1] : 0;
+			unsigned lit_state = ((pos & ((1 << lp) - 1)) << lc) + (prev >> (8 - lc));
+			uint16_t *lit = p->literal + 0x300 * lit_state;
+			unsigned symbol = 1;
+
+			if (state >= 7) {
+				unsigned match_byte = out[pos - rep0 - 1];
+
+				do {
+					unsigned match_bit = (match_byte >> 7) & 1;
+					unsigned bit;
+
+					match_byte <<= 1;
+					bit = rc_bit(lz, &lit[((1 + match_bit) << 8) + symbol]);
+					symbol = (symbol << 1) | bit;
+					if (match_bit != bit)
+						break;
+				} while (symbol < 0x100);
+			}
+
+			while (symbol < 0x100)
+				symbol = (symbol << 1) | rc_bit(lz, &lit[symbol]);
+
+			out[pos++] = symbol;
+			state = (state < 4)? 0 : (state < 10)? state - 3 : state - 6;
+			continue;
+		}
+
+		if (rc_bit(lz, &p->is_rep[state])) {
+			/* Repeated match */
+			if (pos == 0)
+				return -1;
+
+			if (!rc_bit(lz, &p->is_rep_g0[state])) {
+				if (!rc_bit(lz, &p->is_rep0_long[state << LZMA_POS_BITS_MAX | pos_state])) {
+					/* Short rep: a single byte */
+					state = (state < 7)? 9 : 11;
+					out[pos] = out[pos - rep0 - 1];
+					pos++;
+					continue;
+				}
+			} else {
+				uint32_t dist;
+
+				if (!rc_bit(lz, &p->is_rep_g1[state])) {
+					dist = rep1;
+				} else {
+					if (!rc_bit(lz, &p->is_rep_g2[state])) {
+						dist = rep2;
+					} else {
+						dist = rep3;
+						rep3 = rep2;
+					}
+					rep2 = rep1;
+				}
+				rep1 = rep0;
+				rep0 = dist;
+			}
+
+			len = lzma_len(lz, &p->rep_len, pos_state);
+			state = (state < 7)? 8 : 11;
+		} else {
+			/* Simple match */
+			rep3 = rep2;
+			rep2 = rep1;
+			rep1 = rep0;
+			len = lzma_len(lz, &p->len, pos_state);
+			state = (state < 7)? 7 : 10;
+			rep0 = lzma_dist(lz, len);
+
+			/* End marker */
+			if (rep0 == ~0u)
+				break;
+			if (rep0 >= pos)
+				return -1;
+		}
+
+		len += LZMA_MATCH_MIN;
+		if (len > size - pos)
+			return -1;
+
+		for (unsigned i = 0; i < len; i++, pos++)
+			out[pos] = out[pos - rep0 - 1];
+	}
+
+	if (lz->error)
+		return -1;
+
+	return pos;
+}
+
+#endif /* BOOT1 */
+
+
+/* Clock controller */
+
+#define CLK_BASE	0xbf500000
+#define CLK_REG20	(CLK_BASE + 0x20)
+#define CLK_REG20_SLOW_MUX BIT(30)
+#define CLK_SPI0_MUX	(CLK_BASE + 0x4c)
+#define CLK_SPI0_MUX_MASK 7	/* see CLK.SPI0_MUX_* in interact.py */
+
+static uint32_t clk_rate_slow(void)
+{
+	return (read32(CLK_REG20) & CLK_REG20_SLOW_MUX)? 24000000 : 27000000;
+}
+
+
 /* SPI driver */
 
-#define SPI_BASE	0xbf010000
-#define SPI_TRXFIFO	(SPI_BASE + 0x000)
-#define SPI_TRXLEN	(SPI_BASE + 0x120)
-#define SPI_CONTROL	(SPI_BASE + 0x124)
+#define SPI0_BASE	0xbf010000	/* the flash */
+#define SPI1_BASE	0xbf159000
+#define SPI_TRXFIFO	0x000
+#define SPI_TRXLEN	0x120
+#define SPI_CONTROL	0x124
 #define SPI_CONTROL_TX	3
 #define SPI_CONTROL_RX	5
 #define SPI_CONTROL_CMDLEN_SHIFT 16
-#define SPI_STATUS	(SPI_BASE + 0x140)
+#define SPI_STATUS	0x140
 #define SPI_STATUS_BUSY BIT(16)
 #define SPI_STATUS_RXLVL 0x0000003f
 #define SPI_STATUS_TXLVL 0x00003f00
 #define SPI_STATUS_TXLVL_HIGH 0x00003f00
-#define SPI_CMDFIFO	(SPI_BASE + 0x148)
+#define SPI_CMDFIFO	0x148
+#define SPI_CMD_MAX	0x1f
 
 static void spi_init(void)
 {
-	write32(SPI_CONTROL, 0x200);
+	write32(SPI0_BASE + SPI_CONTROL, 0x200);
 }
 
-static bool spi_can_tx(void)
+static bool spi_can_tx(uint32_t base)
 {
-	return (read32(SPI_STATUS) & SPI_STATUS_TXLVL) < SPI_STATUS_TXLVL_HIGH;
+	return (read32(base + SPI_STATUS) & SPI_STATUS_TXLVL) < SPI_STATUS_TXLVL_HIGH;
 }
 
-static bool spi_can_rx(void)
+static bool spi_can_rx(uint32_t base)
 {
-	return (read32(SPI_STATUS) & SPI_STATUS_RXLVL) != 0;
+	return (read32(base + SPI_STATUS) & SPI_STATUS_RXLVL) != 0;
 }
 
-static void spi_transfer(const uint8_t *cmdbuf, size_t cmdlen,
-			 const uint8_t *txbuf, size_t txlen,
-			 uint8_t *rxbuf, size_t rxlen)
+/* Send a command and then either send or receive data, on the controller at base */
+static void spi_transfer_on(uint32_t base, const uint8_t *cmdbuf, size_t cmdlen,
+			    const uint8_t *txbuf, size_t txlen,
+			    uint8_t *rxbuf, size_t rxlen)
 {
 	uint32_t control = cmdlen << SPI_CONTROL_CMDLEN_SHIFT;
 	if (txlen) {
 		control |= SPI_CONTROL_TX;
-		write32(SPI_TRXLEN, txlen);
+		write32(base + SPI_TRXLEN, txlen);
 	} else {
 		control |= SPI_CONTROL_RX;
-		write32(SPI_TRXLEN, rxlen);
+		write32(base + SPI_TRXLEN, rxlen);
 	}
-	write32(SPI_CONTROL, read32(SPI_CONTROL) & 0x1e00);
-	write32(SPI_CONTROL, read32(SPI_CONTROL) | control);
+	write32(base + SPI_CONTROL, read32(base + SPI_CONTROL) & 0x1e00);
+	write32(base + SPI_CONTROL, read32(base + SPI_CONTROL) | control);
 
 	for (size_t i = 0; i < cmdlen; i++)
-		write32(SPI_CMDFIFO, cmdbuf[i]);
+		write32(base + SPI_CMDFIFO, cmdbuf[i]);
 
 	while (txlen) {
-		if (spi_can_tx()) {
+		if (spi_can_tx(base)) {
 			uint32_t word = 0;
 			size_t bytes = min(4, txlen);
 
 			for (size_t i = 0; i < bytes; i++)
 				word |= *txbuf++ << i * 8;
 
-			write32(SPI_TRXFIFO, word);
+			write32(base + SPI_TRXFIFO, word);
 			txlen -= bytes;
 		}
 	}
 
 	while (rxlen) {
-		if (read32(SPI_STATUS) & SPI_STATUS_RXLVL) {
-			uint32_t word = read32(SPI_TRXFIFO);
+		if (spi_can_rx(base)) {
+			uint32_t word = read32(base + SPI_TRXFIFO);
 			size_t bytes = min(4, rxlen);
 
 			for (size_t i = 0; i < bytes; i++)
@@ -292,41 +1014,81 @@ static void spi_transfer(const uint8_t *cmdbuf, size_t cmdlen,
 		}
 	}
 
-	while (read32(SPI_STATUS) & SPI_STATUS_BUSY)
+	while (read32(base + SPI_STATUS) & SPI_STATUS_BUSY)
 		;
 }
 
-static void flash_read(uint32_t addr, uint8_t *buf, size_t size)
+/* A transfer with the flash on SPI0 */
+static void spi_transfer(const uint8_t *cmdbuf, size_t cmdlen,
+			 const uint8_t *txbuf, size_t txlen,
+			 uint8_t *rxbuf, size_t rxlen)
 {
-	uint8_t cmd[4] = {
-		0x03,
-		addr >> 16,
-		addr >> 8,
-		addr
-	};
-	spi_transfer(cmd, sizeof(cmd), NULL, 0, buf, size);
+	spi_transfer_on(SPI0_BASE, cmdbuf, cmdlen, txbuf, txlen, rxbuf, rxlen);
 }
 
-/* If the flash has any bits cleared that are set in the new data, we
-   need an erase to set these bits again. */
-static bool flash_page_needs_erase(uint32_t addr, const uint8_t *data, size_t size)
+#define FLASH_READ	0x03
+#define FLASH_FAST_READ	0x0b	/* one dummy byte after the address, but works at higher clocks */
+
+/* boot1 runs before anything has probed the flash, so it sticks to plain Read */
+#ifdef BOOT1
+static const uint8_t flash_read_cmd = FLASH_READ;
+#else
+static uint8_t flash_read_cmd = FLASH_FAST_READ;
+#endif
+
+#define FLASH_SECTOR	(4 * KiB)	/* smallest erase, and the unit flwr works in */
+#define FLASH_PAGE	256		/* program page, unless SFDP says otherwise */
+#define FLASH_PAGE_MAX	1024
+#define FLASH_UNIT	(FLASH_SECTOR / 32)	/* what flwr tracks as changed, one bit each */
+
+/* Erase commands */
+#define FLASH_SE	0x20	/* Sector Erase, 4 KiB */
+#define FLASH_BE32	0x52	/* Block Erase, 32 KiB */
+#define FLASH_BE64	0xd8	/* Block Erase, 64 KiB */
+
+enum { ERASE_4K, ERASE_32K, ERASE_64K, ERASE_TYPES };
+
+/*
+ * Parameters of the flash chip. The defaults fit the 4 MiB chips on the
+ * known boards, and are updated from the JEDEC ID and SFDP by flash_probe.
+ */
+static struct flash_info {
+	uint8_t id[3];
+	uint32_t size;
+	uint32_t page;
+	uint8_t addr_len;
+	uint8_t erase_op[ERASE_TYPES];	/* 0 if not supported */
+	uint16_t erase_ms[ERASE_TYPES];	/* typical time, 0 if unknown */
+} flash_info = {
+	.size = 4 * MiB,
+	.page = FLASH_PAGE,
+	.addr_len = 3,
+	.erase_op = { FLASH_SE, FLASH_BE32, FLASH_BE64 },
+};
+
+/* Put an opcode and an address into cmd, and return the length */
+static size_t flash_cmd(uint8_t *cmd, uint8_t op, uint32_t addr)
 {
-	uint8_t buf[128];
+	size_t n = 0;
 
-	while (size) {
-		size_t chunk = min(sizeof(buf), size);
-		flash_read(addr, buf, chunk);
+	cmd[n++] = op;
+	if (flash_info.addr_len == 4)
+		cmd[n++] = addr >> 24;
+	cmd[n++] = addr >> 16;
+	cmd[n++] = addr >> 8;
+	cmd[n++] = addr;
 
-		for (size_t i = 0; i < chunk; i++)
-			if (~buf[i] & data[i])
-				return true;
+	return n;
+}
 
-		addr += chunk;
-		data += chunk;
-		size -= chunk;
-	}
+static void flash_read(uint32_t addr, uint8_t *buf, size_t size)
+{
+	uint8_t cmd[6];
+	size_t n = flash_cmd(cmd, flash_read_cmd, addr);
 
-	return false;
+	if (flash_read_cmd == FLASH_FAST_READ)
+		cmd[n++] = 0;
+	spi_transfer(cmd, n, NULL, 0, buf, size);
 }
 
 /* Read status register */
@@ -338,11 +1100,17 @@ static uint8_t flash_rsr(void)
 	return resp;
 }
 
-/* Poll the Write-in-progress/BUSY bit */
+/* Check the Write-in-progress/BUSY bit */
+static bool flash_busy(void)
+{
+	return flash_rsr() & 1;
+}
+
+/* Poll the Write-in-progress/BUSY bit */
 static void flash_poll_wip(void)
 {
-	while (flash_rsr() & 1)
-		;
+	while (flash_busy())
+		uart_poll();
 }
 
 /* Write Enable */
@@ -353,35 +1121,225 @@ static void flash_wren(void)
 	spi_transfer(&cmd, sizeof(cmd), NULL, 0, NULL, 0);
 }
 
-/* Sector Erase (4 KiB) */
-static void flash_erase4k(uint32_t addr)
+/* Start an erase, without waiting for it to complete */
+static void flash_erase_start(uint8_t op, uint32_t addr)
 {
-	uint8_t cmd[] = {
-		0x20,
-		addr >> 16,
-		addr >> 8,
-		addr
-	};
+	uint8_t cmd[5];
+	size_t n = flash_cmd(cmd, op, addr);
 
 	flash_wren();
-	spi_transfer(cmd, sizeof(cmd), NULL, 0, NULL, 0);
-	flash_poll_wip();
+	spi_transfer(cmd, n, NULL, 0, NULL, 0);
+}
+
+/*
+ * SFDP only gives typical erase times, and chips may take several times as
+ * long. Give up after ten times that, or FLASH_ERASE_MAX_MS if it is unknown.
+ */
+#define FLASH_ERASE_MAX_MS	3000
+
+static uint32_t flash_erase_timeout(int type)
+{
+	return flash_info.erase_ms[type]? flash_info.erase_ms[type] * 10 : FLASH_ERASE_MAX_MS;
+}
+
+/* Erase and wait for it. Returns false on timeout */
+static bool flash_erase(int type, uint32_t addr)
+{
+	uint32_t start;
+
+	flash_erase_start(flash_info.erase_op[type], addr);
+	start = timer_get();
+	while (flash_busy()) {
+		if (check_timeout(start, flash_erase_timeout(type))) {
+			puts("Flash erase timeout");
+			return false;
+		}
+		uart_poll();
+	}
+
+	return true;
+}
+
+/* Start programming (up to) a page, without waiting for it to complete */
+static void flash_program_start(uint32_t addr, const uint8_t *data, size_t size)
+{
+	uint8_t cmd[5];
+	size_t n = flash_cmd(cmd, 0x02, addr);
+
+	flash_wren();
+	spi_transfer(cmd, n, data, size, NULL, 0);
 }
 
-/* Program a page (256 bytes at once) */
 static void flash_program_page(uint32_t addr, const uint8_t *data, size_t size)
 {
-	uint8_t cmd[] = {
-		0x02,
+	flash_program_start(addr, data, size);
+	flash_poll_wip();
+}
+
+/* flwr and flst rely on 4 KiB erases, which SFDP may say aren't there */
+static bool flash_check_erase(void)
+{
+	if (flash_info.erase_op[ERASE_4K])
+		return true;
+
+	puts("Flash doesn't support 4 KiB erases");
+	return false;
+}
+
+#ifndef BOOT1
+#define FLASH_RDID	0x9f	/* Read JEDEC ID */
+#define FLASH_RDSFDP	0x5a	/* Read SFDP, like Fast Read */
+#define FLASH_EN4B	0xb7	/* Enter 4-byte address mode */
+#define FLASH_EX4B	0xe9	/* Exit 4-byte address mode */
+
+/*
+ * Chips above 16 MiB are used in 4-byte address mode, but code that lolmon
+ * calls expects 3-byte addresses, as after reset.
+ */
+static void flash_addr_mode(bool four)
+{
+	uint8_t cmd = four? FLASH_EN4B : FLASH_EX4B;
+
+	if (flash_info.addr_len == 4)
+		spi_transfer(&cmd, 1, NULL, 0, NULL, 0);
+}
+
+static void flash_read_sfdp(uint32_t addr, void *buf, size_t size)
+{
+	uint8_t cmd[5] = {
+		FLASH_RDSFDP,
 		addr >> 16,
 		addr >> 8,
-		addr
+		addr,
+		0
 	};
+	spi_transfer(cmd, sizeof(cmd), NULL, 0, buf, size);
+}
 
-	flash_wren();
-	spi_transfer(cmd, sizeof(cmd), data, size, NULL, 0);
-	flash_poll_wip();
+/* Decode an SFDP erase time: count in bits 4:0, unit in bits 6:5 */
+static uint16_t sfdp_erase_ms(uint32_t field)
+{
+	static const uint16_t units[] = { 1, 16, 128, 1000 };
+
+	return ((field & 0x1f) + 1) * units[field >> 5 & 3];
+}
+
+/*
+ * Read the JEDEC ID and the Basic Flash Parameter Table of SFDP (JESD216),
+ * and update flash_info from them. Multi-I/O read modes that SFDP may list
+ * can't be used with this SPI controller, so reads stay with Fast Read.
+ */
+static void flash_probe(void)
+{
+	uint8_t cmd = FLASH_RDID, hdr[16];
+	uint32_t dw[16] = { 0 }, len, ptr;
+
+	spi_transfer(&cmd, 1, NULL, 0, flash_info.id, sizeof(flash_info.id));
+
+	/* Without SFDP, the capacity byte of the ID is the best guess for the size */
+	if (flash_info.id[2] >= 0x10 && flash_info.id[2] <= 0x1f)
+		flash_info.size = 1 << flash_info.id[2];
+
+	flash_read_sfdp(0, hdr, sizeof(hdr));
+	if (strncmp((const char *)hdr, "SFDP", 4) || hdr[8] != 0x00 || hdr[15] != 0xff)
+		return;
+
+	/* The first parameter header always describes the basic table */
+	len = min(hdr[11], ARRAY_LENGTH(dw));
+	ptr = hdr[12] | hdr[13] << 8 | hdr[14] << 16;
+	flash_read_sfdp(ptr, dw, len * 4);
+	if (len < 9)
+		return;
+
+	if (dw[1] & BIT(31))
+		flash_info.size = 1 << ((dw[1] & 0x7fffffff) - 3);
+	else
+		flash_info.size = (dw[1] + 1) / 8;
+
+	/* 4-byte addresses are needed above 16 MiB, or if they're the only option */
+	if ((dw[0] >> 17 & 3) == 2 || ((dw[0] >> 17 & 3) == 1 && flash_info.size > 16 * MiB)) {
+		flash_info.addr_len = 4;
+		flash_addr_mode(true);
+	}
+
+	/* Erase types 1 to 4: size as a power of two, and opcode */
+	for (int i = 0; i < ERASE_TYPES; i++) {
+		flash_info.erase_op[i] = 0;
+		flash_info.erase_ms[i] = 0;
+	}
+	for (int i = 0; i < 4; i++) {
+		uint32_t type = dw[7 + i / 2] >> (i % 2 * 16);
+		int which;
+
+		switch (type & 0xff) {
+		case 12: which = ERASE_4K; break;
+		case 15: which = ERASE_32K; break;
+		case 16: which = ERASE_64K; break;
+		default: continue;
+		}
+		flash_info.erase_op[which] = type >> 8;
+		if (len >= 10)
+			flash_info.erase_ms[which] = sfdp_erase_ms(dw[9] >> (4 + 7 * i));
+	}
+
+	if (len >= 11)
+		flash_info.page = min(1 << (dw[10] >> 4 & 0xf), FLASH_PAGE_MAX);
+}
+#endif /* BOOT1 */
+
+
+#ifndef BOOT1
+/* I2C driver, as in talk2, but for any of the controllers */
+
+static const uint32_t i2c_bases[] = {
+	0xbf560000, 0xbf570000, 0xbf158000, 0xbf15c000, 0xbf580000
+};
+
+#define I2C_STATUS	0x04
+#define I2C_STATUS_ERROR	0xa0
+#define I2C_WRITE	0x08
+#define I2C_READ	0x0c
+#define I2C_CONTROL	0x14
+#define I2C_CONTROL_DONE	0x04
+#define I2C_CONTROL_SPECIAL	0x04	/* on reads: the last byte */
+#define I2C_CONTROL_READ	0x10
+#define I2C_CONTROL_WRITE	0x20
+#define I2C_CONTROL_STOP	0x40
+#define I2C_CONTROL_START	0x80
+#define I2C_TIMEOUT_MS	100
+
+/* Start a step of a transfer and wait for it. Returns the status, or -1 on timeout */
+static int i2c_step(uint32_t base, uint8_t control)
+{
+	uint32_t start = timer_get();
+
+	write8(base + I2C_CONTROL, control);
+	while (read8(base + I2C_CONTROL) != I2C_CONTROL_DONE)
+		if (check_timeout(start, I2C_TIMEOUT_MS))
+			return -1;
+
+	return read8(base + I2C_STATUS);
+}
+
+static int i2c_write(uint32_t base, uint8_t value, bool start)
+{
+	write8(base + I2C_WRITE, value);
+	return i2c_step(base, I2C_CONTROL_WRITE | (start? I2C_CONTROL_START : 0));
+}
+
+static int i2c_stop(uint32_t base)
+{
+	return i2c_step(base, I2C_CONTROL_STOP);
+}
+
+static int i2c_read(uint32_t base, uint8_t *value, bool last)
+{
+	int status = i2c_step(base, I2C_CONTROL_READ | (last? I2C_CONTROL_SPECIAL : 0));
+
+	*value = read8(base + I2C_READ);
+	return status;
 }
+#endif /* BOOT1 */
 
 
 /* Command interpreter */
@@ -390,305 +1348,2473 @@ struct command {
 	/* The name of the command, null-terminated if possible */
 	char name[4];
 
-	/* A description of the arguments */
-	const char *arguments;
+	/* A description of the arguments */
+	const char *arguments;
+
+	/* A description of the function */
+	const char *description;
+
+	/* The implementation */
+	void (*function)(int argc, char **argv);
+};
+
+static void cmd_echo(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		putstr(argv[i]);
+		putchar(' ');
+	}
+	putchar('\n');
+}
+
+static void cmd_read(int argc, char **argv)
+{
+	size_t elems_per_line, increment, elems, addr, stride = 0, pos = 0;
+	char op = argv[0][1];
+
+	switch (argc) {
+	case 2:
+		elems = 1;
+		break;
+	case 3:
+#ifndef BOOT1
+	case 4:
+		if (argc == 4 && !parse_int(argv[3], 16, &stride))
+			return;
+#endif
+		if (!parse_int(argv[2], 0, &elems))
+			return;
+		break;
+	default:
+		puts("Usage error");
+		return;
+	}
+
+	switch (op) {
+	case 'b':
+		elems_per_line = 16;
+		increment = 1;
+		break;
+	case 'h':
+		elems_per_line = 16;
+		increment = 2;
+		break;
+	case 'w':
+		elems_per_line = 8;
+		increment = 4;
+		break;
+	default:
+		return;
+	}
+
+	if (stride)
+		increment = stride;
+
+	if (!parse_int(argv[1], 16, &addr))
+		return;
+
+	for (size_t i = 0; i < elems; i++) {
+		uint32_t value;
+
+		/* Beginning of the line */
+		if (pos == 0) {
+			if (i)
+				putchar('\n');
+			put_hex32(addr);
+			putstr(": ");
+		} else {
+			putchar(' ');
+		}
+
+		switch (op) {
+		case 'b':
+			value = read8(addr);
+			put_hex8(value);
+			break;
+		case 'h':
+			value = read16(addr);
+			put_hex16(value);
+			break;
+		case 'w':
+			value = read32(addr);
+			put_hex32(value);
+			break;
+		}
+
+		addr += increment;
+		if (++pos == elems_per_line)
+			pos = 0;
+	}
+
+	putchar('\n');
+}
+
+static void cmd_write(int argc, char **argv)
+{
+	size_t increment, addr;
+	char op = argv[0][1];
+
+	if (argc < 3) {
+		puts("Usage error");
+		return;
+	}
+
+	switch (op) {
+	case 'b':
+		increment = 1;
+		break;
+	case 'h':
+		increment = 2;
+		break;
+	case 'w':
+		increment = 4;
+		break;
+	default:
+		return;
+	}
+
+	if (!parse_int(argv[1], 16, &addr))
+		return;
+
+	for (int i = 2; i < argc; i++) {
+		uint32_t value;
+
+		if (!parse_int(argv[i], 0, &value))
+			return;
+
+		switch (op) {
+		case 'b':
+			write8(addr, value);
+			break;
+		case 'h':
+			write16(addr, value);
+			break;
+		case 'w':
+			write32(addr, value);
+			break;
+		}
+
+		addr += increment;
+	}
+}
+
+#ifndef BOOT1
+/*
+ * Read or write a list of addresses, which may be scattered over the address
+ * space: rv prints the values on one line, wv takes a value after each address.
+ * The width is a word, and b, h or w among the arguments change it.
+ */
+static void cmd_vector(int argc, char **argv)
+{
+	uint32_t addr, value;
+	bool write = argv[0][0] == 'w';
+	char op = 'w';
+
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][1] == 0 &&
+		    (argv[i][0] == 'b' || argv[i][0] == 'h' || argv[i][0] == 'w')) {
+			op = argv[i][0];
+			continue;
+		}
+		if (!parse_int(argv[i], 16, &addr))
+			return;
+
+		if (write) {
+			if (++i == argc) {
+				puts("Usage error");
+				return;
+			}
+			if (!parse_int(argv[i], 0, &value))
+				return;
+
+			switch (op) {
+			case 'b': write8(addr, value); break;
+			case 'h': write16(addr, value); break;
+			default: write32(addr, value); break;
+			}
+		} else {
+			if (i > 1)
+				putchar(' ');
+
+			switch (op) {
+			case 'b': put_hex8(read8(addr)); break;
+			case 'h': put_hex16(read16(addr)); break;
+			default: put_hex32(read32(addr)); break;
+			}
+		}
+	}
+
+	if (!write)
+		putchar('\n');
+}
+
+/*
+ * Read-modify-write a value in memory or a register: mb/mh/mw replace the
+ * bits under a mask, setb/clrb and friends set or clear bits.
+ */
+static void cmd_modify(int argc, char **argv)
+{
+	uint32_t addr, mask, value;
+	char kind = argv[0][0];
+	char op = argv[0][kind == 'm'? 1 : 3];
+
+	if (argc != 3 + (kind == 'm') ||
+	    !parse_int(argv[1], 16, &addr) ||
+	    !parse_int(argv[2], 0, &mask) ||
+	    (kind == 'm' && !parse_int(argv[3], 0, &value))) {
+		puts("Usage error");
+		return;
+	}
+	if (kind != 'm')
+		value = (kind == 's')? mask : 0;
+	value &= mask;
+
+	switch (op) {
+	case 'b': write8(addr, (read8(addr) & ~mask) | value); break;
+	case 'h': write16(addr, (read16(addr) & ~mask) | value); break;
+	default: write32(addr, (read32(addr) & ~mask) | value); break;
+	}
+}
+#endif /* BOOT1 */
+
+/*
+ * Wait until a value in memory or a register matches under a mask, or time
+ * runs out. With "!value", wait until it no longer matches.
+ */
+static void cmd_poll(int argc, char **argv)
+{
+	uint32_t addr, mask, expected, timeout = 1000, value, start;
+	char op = argv[0][1];
+	bool negate = argc >= 4 && argv[3][0] == '!';
+
+	if ((argc != 4 && argc != 5) ||
+	    !parse_int(argv[1], 16, &addr) ||
+	    !parse_int(argv[2], 0, &mask) ||
+	    !parse_int(argv[3] + negate, 0, &expected) ||
+	    (argc == 5 && !parse_int(argv[4], 0, &timeout))) {
+		puts("Usage error");
+		return;
+	}
+
+	start = timer_get();
+	while (true) {
+		switch (op) {
+		case 'b': value = read8(addr); break;
+		case 'h': value = read16(addr); break;
+		default: value = read32(addr); break;
+		}
+
+		if (((value & mask) == expected) != negate)
+			break;
+		if (check_timeout(start, timeout)) {
+			putstr("Timeout, ");
+			break;
+		}
+		uart_poll();
+	}
+
+	put_hex32(value);
+	putchar('\n');
+}
+
+/* Copy element by element, with accesses of the requested size */
+static void copy_elements(uint32_t dest, uint32_t src, uint32_t count, size_t size)
+{
+	for (size_t i = 0; i < count; i++) {
+		switch (size) {
+		case 1:
+			write8(dest, read8(src));
+			break;
+		case 2:
+			write16(dest, read16(src));
+			break;
+		case 4:
+			write32(dest, read32(src));
+			break;
+		}
+
+		src  += size;
+		dest += size;
+
+		if ((i & 0xfff) == 0xfff)
+			uart_poll();
+	}
+}
+
+#ifndef BOOT1
+struct unaligned32 {
+	uint32_t value;
+} __attribute__((packed));
+
+/*
+ * Copy RAM a cache line at a time, prefetching the source and allocating the
+ * destination lines without reading them. The ranges must not overlap.
+ */
+static void memcpy_fast(uint32_t dest, uint32_t src, size_t size)
+{
+	uint32_t end = dest + size;
+
+	while (dest % 4 && dest != end)
+		write8(dest++, read8(src++));
+
+	if (src % 4) {
+		/* Misaligned relative to each other: unaligned loads, aligned stores */
+		for (; end - dest >= 4; dest += 4, src += 4) {
+			write32(dest, ((const struct unaligned32 *)src)->value);
+			if (dest % (64 * KiB) == 0)
+				uart_poll();
+		}
+	} else {
+		for (; dest % CACHE_LINE && end - dest >= 4; dest += 4, src += 4)
+			write32(dest, read32(src));
+
+		for (; end - dest >= CACHE_LINE; dest += CACHE_LINE, src += CACHE_LINE) {
+			uint32_t w0, w1, w2, w3, w4, w5, w6, w7;
+
+			if (end - dest >= 3 * CACHE_LINE)
+				pref(PREF_LOAD, src + 2 * CACHE_LINE);
+			pref(PREF_PREPARE_FOR_STORE, dest);
+
+			w0 = read32(src + 0x00);
+			w1 = read32(src + 0x04);
+			w2 = read32(src + 0x08);
+			w3 = read32(src + 0x0c);
+			w4 = read32(src + 0x10);
+			w5 = read32(src + 0x14);
+			w6 = read32(src + 0x18);
+			w7 = read32(src + 0x1c);
+			write32(dest + 0x00, w0);
+			write32(dest + 0x04, w1);
+			write32(dest + 0x08, w2);
+			write32(dest + 0x0c, w3);
+			write32(dest + 0x10, w4);
+			write32(dest + 0x14, w5);
+			write32(dest + 0x18, w6);
+			write32(dest + 0x1c, w7);
+
+			if (dest % (64 * KiB) == 0)
+				uart_poll();
+		}
+
+		for (; end - dest >= 4; dest += 4, src += 4)
+			write32(dest, read32(src));
+	}
+
+	while (dest != end)
+		write8(dest++, read8(src++));
+}
+
+/* Whether memcpy_fast may be used instead of copying element by element */
+static bool copy_is_ram(uint32_t dest, uint32_t src, uint32_t size)
+{
+	return src < MMIO_BASE && size <= MMIO_BASE - src &&
+	       dest < MMIO_BASE && size <= MMIO_BASE - dest &&
+	       (src + size <= dest || dest + size <= src);
+}
+#endif /* BOOT1 */
+
+static void cmd_copy(int argc, char **argv)
+{
+	uint32_t size, src, dest, count;
+	char op = argv[0][1];
+
+	if (argc != 4) {
+		puts("Usage error");
+		return;
+	}
+
+	switch (op) {
+	case 'b':
+		size = 1;
+		break;
+	case 'h':
+		size = 2;
+		break;
+	case 'w':
+		size = 4;
+		break;
+	default:
+		return;
+	}
+
+	if (!parse_int(argv[1], 16, &src))
+		return;
+	if (!parse_int(argv[2], 16, &dest))
+		return;
+	if (!parse_int(argv[3], 0, &count))
+		return;
+
+#ifndef BOOT1
+	/* MMIO, and overlapping ranges, are copied one element at a time, in order */
+	if (copy_is_ram(dest, src, count * size)) {
+		memcpy_fast(dest, src, count * size);
+		return;
+	}
+#endif
+
+	copy_elements(dest, src, count, size);
+}
+
+#ifndef BOOT1
+/* Print a number with three decimal places */
+static void put_milli(uint32_t whole, uint32_t thousandths)
+{
+	put_dec(whole);
+	putchar('.');
+	putchar('0' + thousandths / 100);
+	putchar('0' + thousandths / 10 % 10);
+	putchar('0' + thousandths % 10);
+}
+
+/* Throughput in kB/s */
+static uint32_t rate_kb(uint32_t bytes, uint32_t ticks)
+{
+	/* The timer runs at 3.275 MHz, so bytes * 3275 / ticks is in kB/s */
+	while (bytes > 0xffffffff / 3275) {
+		bytes >>= 1;
+		ticks >>= 1;
+	}
+	return bytes * 3275 / max(ticks, 1);
+}
+
+/* Print a throughput in MB/s */
+static void put_rate(uint32_t bytes, uint32_t ticks)
+{
+	uint32_t rate = rate_kb(bytes, ticks);
+
+	put_milli(rate / 1000, rate % 1000);
+	puts(" MB/s");
+}
+
+/* Compare the byte-wise and the fast copy */
+static void cmd_cbm(int argc, char **argv)
+{
+	uint32_t src, dest, size, start;
+
+	if (argc != 4 ||
+	    !parse_int(argv[1], 16, &src) ||
+	    !parse_int(argv[2], 16, &dest) ||
+	    !parse_int(argv[3], 0, &size) ||
+	    !copy_is_ram(dest, src, size)) {
+		puts("Usage error");
+		return;
+	}
+
+	start = timer_get();
+	copy_elements(dest, src, size, 1);
+	putstr("Byte copy: ");
+	put_rate(size, timer_get() - start);
+
+	start = timer_get();
+	memcpy_fast(dest, src, size);
+	putstr("Fast copy: ");
+	put_rate(size, timer_get() - start);
+}
+
+/* Fill memory with a byte, half-word or word pattern */
+static void cmd_fill(int argc, char **argv)
+{
+	uint32_t addr, value, count, end, size;
+	char op = argv[0][1];
+
+	if (argc != 4 ||
+	    !parse_int(argv[1], 16, &addr) ||
+	    !parse_int(argv[2], 0, &value) ||
+	    !parse_int(argv[3], 0, &count)) {
+		puts("Usage error");
+		return;
+	}
+
+	switch (op) {
+	case 'b':
+		size = 1;
+		value = (value & 0xff) * 0x01010101;
+		break;
+	case 'h':
+		size = 2;
+		value = (value & 0xffff) * 0x00010001;
+		break;
+	default:
+		size = 4;
+		break;
+	}
+
+	if (addr & (size - 1)) {
+		puts("Unaligned address");
+		return;
+	}
+
+	end = addr + count * size;
+	while (addr != end) {
+		if (addr >= MMIO_BASE || addr % 4 || end - addr < 4) {
+			/* MMIO, or the unaligned edges of RAM: stores of the requested size */
+			if (size == 1)
+				write8(addr, value);
+			else if (size == 2)
+				write16(addr, value);
+			else
+				write32(addr, value);
+			addr += size;
+		} else if (addr % CACHE_LINE == 0 && end - addr >= CACHE_LINE) {
+			pref(PREF_PREPARE_FOR_STORE, addr);
+			write32(addr + 0x00, value);
+			write32(addr + 0x04, value);
+			write32(addr + 0x08, value);
+			write32(addr + 0x0c, value);
+			write32(addr + 0x10, value);
+			write32(addr + 0x14, value);
+			write32(addr + 0x18, value);
+			write32(addr + 0x1c, value);
+			addr += CACHE_LINE;
+
+			if (addr % (64 * KiB) == 0)
+				uart_poll();
+		} else {
+			write32(addr, value);
+			addr += 4;
+		}
+	}
+}
+#endif /* BOOT1 */
+
+/*
+ * Binary transfers: The data is split into frames, each consisting of a
+ * 16-bit length, the payload, and a CRC-32 of the payload (all little-endian).
+ * The receiver answers each frame with ACK or NAK; after a NAK, the same
+ * frame is sent again.
+ */
+
+#define ACK 0x06
+#define NAK 0x15
+#define FRAME_MAX 4096
+#define FRAME_TIMEOUT_MS 1000
+
+static void frame_put(uint32_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		uart_tx(value >> i * 8);
+}
+
+static bool frame_get(uint32_t *value, int bytes)
+{
+	uint32_t x = 0;
+
+	for (int i = 0; i < bytes; i++) {
+		int c = getchar_timeout(FRAME_TIMEOUT_MS);
+		if (c < 0)
+			return false;
+		x |= (uint32_t)c << i * 8;
+	}
+
+	*value = x;
+	return true;
+}
+
+/* Discard input until the line goes quiet, to get back in sync with the host */
+static void frame_drain(void)
+{
+	while (getchar_timeout(50) >= 0)
+		;
+}
+
+static void cmd_wbin(int argc, char **argv)
+{
+	uint32_t addr, size, len, crc;
+
+	if (argc != 3 ||
+	    !parse_int(argv[1], 16, &addr) ||
+	    !parse_int(argv[2], 0, &size)) {
+		puts("Usage error");
+		return;
+	}
+
+	uart_flow_pause(true);
+
+	/* Tell the host that we're ready */
+	uart_tx(ACK);
+
+	while (size) {
+		uint8_t *p = (void *)addr;
+
+		if (!frame_get(&len, 2))
+			goto timeout;
+
+		if (len == 0 || len > min(size, FRAME_MAX)) {
+			frame_drain();
+			uart_tx(NAK);
+			continue;
+		}
+
+		for (size_t i = 0; i < len; i++) {
+			int c = getchar_timeout(FRAME_TIMEOUT_MS);
+			if (c < 0)
+				goto timeout;
+			p[i] = c;
+		}
+
+		if (!frame_get(&crc, 4))
+			goto timeout;
+
+		if (crc32_update(0, p, len) != crc) {
+			uart_tx(NAK);
+			continue;
+		}
+
+		uart_tx(ACK);
+		addr += len;
+		size -= len;
+	}
+	return;
+
+timeout:
+	puts("Timeout");
+}
+
+static void cmd_rbin(int argc, char **argv)
+{
+	uint32_t addr, size;
+
+	if (argc != 3 ||
+	    !parse_int(argv[1], 16, &addr) ||
+	    !parse_int(argv[2], 0, &size)) {
+		puts("Usage error");
+		return;
+	}
+
+	uart_flow_pause(true);
+
+	while (size) {
+		const uint8_t *p = (void *)addr;
+		uint32_t len = min(size, FRAME_MAX);
+
+		frame_put(len, 2);
+		for (size_t i = 0; i < len; i++)
+			uart_tx(p[i]);
+		frame_put(crc32_update(0, p, len), 4);
+
+		int c = getchar_timeout(FRAME_TIMEOUT_MS);
+		if (c < 0) {
+			puts("Timeout");
+			return;
+		}
+
+		if (c == ACK) {
+			addr += len;
+			size -= len;
+		}
+	}
+}
+
+#ifndef BOOT1
+
+/*
+ * Receiving a stream of frames while the data is being processed: Each frame
+ * is acknowledged as soon as a buffer is free for the next one, so the host
+ * sends it while the previous frames are being consumed.
+ */
+
+#define CAN 0x18	/* sent to abort the transfer */
+#define FSTREAM_BUFS 16
+#define FSTREAM_NEXT(i) (((i) + 1) % FSTREAM_BUFS)
+
+struct frame_stream {
+	/* A ring of buffers, each holding a raw frame: length, payload, CRC */
+	uint8_t *buf[FSTREAM_BUFS];
+	bool full[FSTREAM_BUFS];
+
+	/* Receiver side */
+	int rx;
+	uint32_t rx_pos;
+	uint32_t remaining;	/* payload bytes still expected from the host */
+	bool ack_pending;
+	bool timeout;
+	uint32_t last_rx;
+
+	/* Consumer side */
+	int cur;
+	uint32_t pos;
+};
+
+static uint32_t frame_len(const uint8_t *raw)
+{
+	return raw[0] | raw[1] << 8;
+}
+
+static void fstream_begin(struct frame_stream *fs, uint32_t size)
+{
+	for (int i = 0; i < FSTREAM_BUFS; i++) {
+		fs->buf[i] = (void *)(SCRATCH_FRAMES + i * (FRAME_MAX + 8));
+		fs->full[i] = false;
+	}
+	fs->rx = fs->cur = 0;
+	fs->rx_pos = fs->pos = 0;
+	fs->remaining = size;
+	fs->ack_pending = false;
+	fs->timeout = false;
+	fs->last_rx = timer_get();
+
+	/* Tell the host that we're ready */
+	uart_tx(ACK);
+}
+
+/* Move received bytes into the buffers. Doesn't block. */
+static void fstream_poll(struct frame_stream *fs)
+{
+	while (true) {
+		if (fs->ack_pending) {
+			/* Ask for the next frame once its buffer is free */
+			if (fs->full[FSTREAM_NEXT(fs->rx)])
+				return;
+			fs->rx = FSTREAM_NEXT(fs->rx);
+			fs->ack_pending = false;
+			fs->last_rx = timer_get();
+			uart_tx(ACK);
+		}
+
+		if (fs->remaining == 0 || uart_rx_level() == 0)
+			return;
+
+		uint8_t *raw = fs->buf[fs->rx];
+		raw[fs->rx_pos++] = uart_rx();
+		fs->last_rx = timer_get();
+
+		if (fs->rx_pos < 2)
+			continue;
+
+		uint32_t len = frame_len(raw);
+		if (len == 0 || len > min(fs->remaining, FRAME_MAX)) {
+			frame_drain();
+			fs->rx_pos = 0;
+			uart_tx(NAK);
+			continue;
+		}
+
+		if (fs->rx_pos < len + 6)
+			continue;
+
+		fs->rx_pos = 0;
+		if (crc32_update(0, raw + 2, len) != get_le32(raw + 2 + len)) {
+			uart_tx(NAK);
+			continue;
+		}
+
+		fs->full[fs->rx] = true;
+		fs->remaining -= len;
+		fs->ack_pending = true;
+	}
+}
+
+/* Get the next byte of the stream, or -1 at its end or on timeout */
+static int fstream_getc(void *arg)
+{
+	struct frame_stream *fs = arg;
+
+	fstream_poll(fs);
+
+	while (!fs->full[fs->cur]) {
+		if (fs->remaining == 0)
+			return -1;
+		if (check_timeout(fs->last_rx, FRAME_TIMEOUT_MS)) {
+			fs->timeout = true;
+			return -1;
+		}
+		fstream_poll(fs);
+	}
+
+	uint8_t *raw = fs->buf[fs->cur];
+	int c = raw[2 + fs->pos++];
+
+	if (fs->pos == frame_len(raw)) {
+		fs->full[fs->cur] = false;
+		fs->cur = FSTREAM_NEXT(fs->cur);
+		fs->pos = 0;
+	}
+
+	return c;
+}
+
+/* Consume the rest of the stream. Returns false if it couldn't be completed. */
+static bool fstream_finish(struct frame_stream *fs)
+{
+	while (fstream_getc(fs) >= 0)
+		;
+
+	return !fs->timeout;
+}
+
+static void fstream_abort(struct frame_stream *fs)
+{
+	(void)fs;
+	frame_drain();
+	uart_tx(CAN);
+}
+
+static void cmd_unlz(int argc, char **argv)
+{
+	struct frame_stream fs;
+	struct lzma lz = {
+		.getc = fstream_getc,
+		.arg = &fs,
+		.probs = (void *)SCRATCH_LZMA,
+	};
+	uint32_t addr, size;
+	long res;
+
+	if (argc != 3 ||
+	    !parse_int(argv[1], 16, &addr) ||
+	    !parse_int(argv[2], 0, &size) ||
+	    (addr & 0x1fffffff) >= (SCRATCH_LOW & 0x1fffffff)) {
+		puts("Usage error");
+		return;
+	}
+
+	uart_flow_pause(true);
+	fstream_begin(&fs, size);
+	res = lzma_decode(&lz, (void *)addr, (SCRATCH_LOW & 0x1fffffff) - (addr & 0x1fffffff));
+	if (res < 0 || !fstream_finish(&fs)) {
+		fstream_abort(&fs);
+		puts(fs.timeout? "Timeout" : "Decompression error");
+		return;
+	}
+
+	putstr("Decompressed ");
+	put_hex32(res);
+	puts(" bytes");
+}
+
+#endif /* BOOT1 */
+
+/* Cache maintenance */
+
+/* Operations for the CACHE instruction */
+#define CACHE_I			0
+#define CACHE_D			1
+#define INDEX_INVALIDATE	(0 << 2)	/* writes back dirty D-cache lines */
+#define HIT_INVALIDATE		(4 << 2)
+#define HIT_WRITEBACK_INV	(5 << 2)	/* D-cache only */
+
+#define cache_op(op, addr) __asm__ volatile("cache %0, 0(%1)" :: "i"(op), "r"(addr))
+
+/* Size and line size of each cache, from Config1. 0 if absent. */
+static struct cache_info {
+	uint32_t size, line;
+} icache, dcache;
+
+static void cache_info_decode(struct cache_info *cache, uint32_t field)
+{
+	uint32_t sets = (field >> 6) & 7, line = (field >> 3) & 7, ways = field & 7;
+
+	cache->line = line? 2 << line : 0;
+	cache->size = (sets == 7? 32 : 64 << sets) * cache->line * (ways + 1);
+}
+
+static void cache_init(void)
+{
+	uint32_t config1 = mfc0(16, 1);
+
+	cache_info_decode(&icache, config1 >> 16);
+	cache_info_decode(&dcache, config1 >> 7);
+}
+
+/*
+ * Write back the D-cache and invalidate the I-cache over a range of addresses,
+ * so that DMA and freshly written code see the data. Ranges bigger than a
+ * cache are handled with index operations over the whole cache.
+ */
+static void cache_flush_range(unsigned long addr, size_t len)
+{
+	unsigned long start, end;
+
+	/* Hit operations need a cached address */
+	addr = (addr & 0x1fffffff) | 0x80000000;
+	end = addr + len;
+
+	if (len >= dcache.size) {
+		for (start = 0x80000000; start < 0x80000000 + dcache.size; start += dcache.line)
+			cache_op(INDEX_INVALIDATE | CACHE_D, start);
+	} else if (dcache.line) {
+		for (start = addr & -dcache.line; start < end; start += dcache.line)
+			cache_op(HIT_WRITEBACK_INV | CACHE_D, start);
+	}
+	__asm__ volatile("sync");
+
+	if (len >= icache.size) {
+		for (start = 0x80000000; start < 0x80000000 + icache.size; start += icache.line)
+			cache_op(INDEX_INVALIDATE | CACHE_I, start);
+	} else if (icache.line) {
+		for (start = addr & -icache.line; start < end; start += icache.line)
+			cache_op(HIT_INVALIDATE | CACHE_I, start);
+	}
+}
+
+static void cmd_sync(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	cache_flush_range(0x80000000, 64 * MiB);
+}
+
+/* MIPS relocations are weird... */
+extern char do_call[1];
+static uint32_t (* do_call_p)(uint32_t fn, uint32_t a1, uint32_t a2, uint32_t a3) = (void *)do_call;
+static void cmd_call(int argc, char **argv)
+{
+	uint32_t fn, args[3] = { 0 };
+	int i;
+
+	if (argc < 2) {
+		puts("Usage error");
+		return;
+	}
+
+	if (!parse_int(argv[1], 16, &fn))
+		return;
+
+	for (i = 0; i < 3 && 2 + i < argc; i++)
+		parse_int(argv[2 + i], 0, &args[i]);
+
+	cache_flush_range(0x80000000, 64 * MiB);
+
+#ifndef BOOT1
+	flash_addr_mode(false);
+#endif
+	fn = do_call_p(fn, args[0], args[1], args[2]);
+#ifndef BOOT1
+	flash_addr_mode(true);
+#endif
+	putstr("Returned ");
+	put_hex32(fn);
+	putchar('\n');
+}
+
+static void source(const char *script);
+static void cmd_src(int argc, char **argv)
+{
+	uint32_t script;
+
+	if (argc != 2) {
+		puts("Usage error");
+		return;
+	}
+
+	if (!parse_int(argv[1], 16, &script))
+		return;
+
+	source((const char *)script);
+}
+
+static void cmd_flrd(int argc, char **argv)
+{
+	uint32_t source, dest, size;
+
+	if (argc != 4 ||
+	    !parse_int(argv[1], 16, &source) ||
+	    !parse_int(argv[2], 16, &dest) ||
+	    !parse_int(argv[3], 0, &size)) {
+		puts("Usage error");
+		return;
+	}
+
+	/* Read in chunks, to keep up with UART input */
+	for (uint32_t pos = 0; pos < size; pos += 4 * KiB) {
+		flash_read(source + pos, (void *)(dest + pos), min(4 * KiB, size - pos));
+		uart_poll();
+	}
+}
+
+#ifndef BOOT1
+/* Partition table of the vendor firmware, see tools/parse-parttable.py */
+#define PART_TABLE	0x10000
+#define PART_TABLE_SIZE	0x400
+#define PART_ENTRY_SIZE	0x30
+#define PART_ID		0x0c
+#define PART_OFFSET	0x10	/* relative to the partition table */
+#define PART_SIZE	0x14
+#define PART_NAME	0x24
+
+/* Reads a range of flash one chunk at a time, for lzma_decode */
+struct flash_stream {
+	uint32_t pos, end;
+	size_t head, tail;
+	uint8_t buf[4 * KiB];
+};
+
+static int flash_getc(void *arg)
+{
+	struct flash_stream *fs = arg;
+
+	if (fs->head == fs->tail) {
+		if (fs->pos >= fs->end)
+			return -1;
+
+		fs->head = 0;
+		fs->tail = min(sizeof(fs->buf), fs->end - fs->pos);
+		flash_read(fs->pos, fs->buf, fs->tail);
+		fs->pos += fs->tail;
+		uart_poll();
+	}
+
+	return fs->buf[fs->head++];
+}
+
+static void cmd_flbt(int argc, char **argv)
+{
+	uint8_t table[PART_TABLE_SIZE], *entry;
+	struct flash_stream fs = { 0 };
+	struct lzma lz = {
+		.getc = flash_getc,
+		.arg = &fs,
+		.probs = (void *)SCRATCH_LZMA,
+	};
+	uint32_t addr = 0x81000000, max;
+	long len;
+	uint8_t id;
+
+	if (argc < 2 || argc > 3 ||
+	    (argc == 3 && !parse_int(argv[2], 16, &addr)) ||
+	    (addr & 0x1fffffff) >= (SCRATCH_LOW & 0x1fffffff)) {
+		puts("Usage error");
+		return;
+	}
+	max = (SCRATCH_LOW & 0x1fffffff) - (addr & 0x1fffffff);
+
+	flash_read(PART_TABLE, table, sizeof(table));
+	if (strncmp((char *)table, "*^_^*DM(^o^)", 12)) {
+		puts("No partition table");
+		return;
+	}
+
+	for (entry = table + 0x10; entry + PART_ENTRY_SIZE <= table + sizeof(table); entry += PART_ENTRY_SIZE) {
+		if (!entry[PART_NAME]) {
+			break;
+		} else if (!strncmp((char *)entry + PART_NAME, argv[1], 8)) {
+			fs.pos = PART_TABLE + get_le32(entry + PART_OFFSET);
+			fs.end = fs.pos + get_le32(entry + PART_SIZE);
+			break;
+		}
+	}
+
+	if (!fs.end) {
+		puts("Partition not found");
+		return;
+	}
+
+	id = entry[PART_ID];
+	if (id == 0x88 || id == 0x89 || id == 0x8c) {
+		len = lzma_decode(&lz, (void *)addr, max);
+		if (len < 0) {
+			puts("Decompression error");
+			return;
+		}
+	} else {
+		len = fs.end - fs.pos;
+		if ((uint32_t)len > max) {
+			puts("Partition too large");
+			return;
+		}
+
+		for (uint32_t pos = 0; pos < (uint32_t)len; pos += 4 * KiB) {
+			flash_read(fs.pos + pos, (void *)(addr + pos), min(4 * KiB, len - pos));
+			uart_poll();
+		}
+	}
+
+	putstr("Loaded ");
+	put_hex32(len);
+	puts(" bytes");
+
+	/* Same arguments as l.call_linux_and_run_microcom() passes to Linux */
+	cache_flush_range(addr, len);
+	flash_addr_mode(false);
+	do_call_p(addr, 0, ~0u, 0);
+	flash_addr_mode(true);
+}
+#endif /* BOOT1 */
+
+/* The bits of the units of a sector that the offsets lo to hi cover */
+static uint32_t flash_units(uint32_t lo, uint32_t hi)
+{
+	return (2u << (hi - 1) / FLASH_UNIT) - (1u << lo / FLASH_UNIT);
+}
+
+/* What flash_write did, per sector */
+struct flash_stats {
+	uint32_t skipped, erased, programmed;
+};
+
+/*
+ * Write data to flash, in 64 KiB blocks: First compare each page with the new
+ * data, then erase the sectors that need it (coalesced into block erases where
+ * possible), and program only the pages that differ or aren't blank. Returns
+ * false if an erase times out.
+ */
+static bool flash_write(uint32_t source, uint32_t dest, uint32_t size, struct flash_stats *stats)
+{
+	uint32_t end = dest + size;
+	uint32_t page_size = flash_info.page;
+	uint8_t buf[FLASH_PAGE_MAX];
+
+	for (uint32_t block = dest & ~(64 * KiB - 1); block < end; block += 64 * KiB) {
+		uint32_t changed[16];
+		uint16_t erase = 0, full = 0;
+
+		for (int i = 0; i < 16; i++) {
+			uint32_t sector = block + i * FLASH_SECTOR;
+			uint32_t lo = max(sector, dest), hi = min(sector + FLASH_SECTOR, end);
+
+			changed[i] = 0;
+			if (lo >= hi)
+				continue;
+			if (lo == sector && hi == sector + FLASH_SECTOR)
+				full |= BIT(i);
+
+			for (uint32_t page = lo & ~(page_size - 1); page < hi; page += page_size) {
+				uint32_t plo = max(page, lo), len = min(page + page_size, hi) - plo;
+				const uint8_t *data = (const uint8_t *)(source + plo - dest);
+
+				flash_read(plo, buf, len);
+				for (uint32_t j = 0; j < len; j++) {
+					if (buf[j] != data[j])
+						changed[i] |= 1u << (plo + j - sector) / FLASH_UNIT;
+					if (~buf[j] & data[j])
+						erase |= BIT(i);
+				}
+			}
+
+			if (!changed[i])
+				stats->skipped++;
+			uart_poll();
+		}
+
+		if (erase == 0xffff && full == 0xffff && flash_info.erase_op[ERASE_64K]) {
+			if (!flash_erase(ERASE_64K, block))
+				return false;
+		} else {
+			for (int i = 0; i < 16; i += 8) {
+				if ((erase >> i & 0xff) == 0xff && (full >> i & 0xff) == 0xff &&
+				    flash_info.erase_op[ERASE_32K]) {
+					if (!flash_erase(ERASE_32K, block + i * FLASH_SECTOR))
+						return false;
+					continue;
+				}
+				for (int j = i; j < i + 8; j++)
+					if (erase & BIT(j) && !flash_erase(ERASE_4K, block + j * FLASH_SECTOR))
+						return false;
+			}
+		}
+
+		for (int i = 0; i < 16; i++) {
+			uint32_t sector = block + i * FLASH_SECTOR;
+			uint32_t lo = max(sector, dest), hi = min(sector + FLASH_SECTOR, end);
+			bool any = false;
+
+			if (!changed[i])
+				continue;
+			if (erase & BIT(i)) {
+				stats->erased++;
+				if (!(full & BIT(i))) {
+					putstr("Warning: erased data outside the destination, in sector ");
+					put_hex32(sector);
+					putchar('\n');
+				}
+			}
+
+			for (uint32_t page = lo & ~(page_size - 1); page < hi; page += page_size) {
+				uint32_t plo = max(page, lo), len = min(page + page_size, hi) - plo;
+				const uint8_t *data = (const uint8_t *)(source + plo - dest);
+				bool blank = true;
+
+				/* After an erase, only pages with non-0xff data need programming */
+				if (erase & BIT(i)) {
+					for (uint32_t j = 0; j < len; j++)
+						blank &= data[j] == 0xff;
+				} else {
+					blank = !(changed[i] & flash_units(plo - sector, plo + len - sector));
+				}
+
+				if (!blank) {
+					flash_program_page(plo, data, len);
+					any = true;
+				}
+			}
+
+			if (any)
+				stats->programmed++;
+		}
+	}
+
+	return true;
+}
+
+static void flash_stats_show(const struct flash_stats *stats)
+{
+	put_dec(stats->skipped);
+	putstr(" sectors unchanged, ");
+	put_dec(stats->erased);
+	putstr(" erased, ");
+	put_dec(stats->programmed);
+	puts(" programmed");
+}
+
+#ifndef BOOT1
+/*
+ * Flash shadow: A copy of the flash in DRAM, which is read sector by sector
+ * when it is first accessed. shwr only changes the shadow and marks sectors
+ * as dirty, and shcm writes the dirty sectors back, so that an update which
+ * touches a sector several times only erases and programs it once.
+ */
+#define SHADOW_SIZE	(4 * MiB)	/* at most the first 4 MiB of larger chips */
+#define SHADOW_SECTORS	(SHADOW_SIZE / FLASH_SECTOR)
+
+static uint32_t shadow_loaded[SHADOW_SECTORS / 32];
+static uint32_t shadow_dirty[SHADOW_SECTORS / 32];
+
+static bool shadow_test(const uint32_t *map, uint32_t sector)
+{
+	return map[sector / 32] & (1u << sector % 32);
+}
+
+static void shadow_set(uint32_t *map, uint32_t sector, bool value)
+{
+	if (value)
+		map[sector / 32] |= 1u << sector % 32;
+	else
+		map[sector / 32] &= ~(1u << sector % 32);
+}
+
+/* Get the shadow copy of a sector, reading it from flash if necessary */
+static uint8_t *shadow_sector(uint32_t sector, bool read)
+{
+	uint8_t *p = (uint8_t *)(SCRATCH_SHADOW + sector * FLASH_SECTOR);
+
+	if (!shadow_test(shadow_loaded, sector)) {
+		if (read)
+			flash_read(sector * FLASH_SECTOR, p, FLASH_SECTOR);
+		shadow_set(shadow_loaded, sector, true);
+	}
+
+	return p;
+}
+
+/* Forget the shadow copies of sectors that were written directly */
+static void shadow_invalidate(uint32_t addr, uint32_t size)
+{
+	for (uint32_t sector = addr / FLASH_SECTOR;
+	     sector < SHADOW_SECTORS && sector * FLASH_SECTOR < addr + size; sector++) {
+		shadow_set(shadow_loaded, sector, false);
+		shadow_set(shadow_dirty, sector, false);
+	}
+}
+#endif /* BOOT1 */
+
+static void cmd_flwr(int argc, char **argv)
+{
+	uint32_t source, dest, size;
+	struct flash_stats stats = { 0 };
+	bool done;
+
+	if (argc != 4 ||
+	    !parse_int(argv[1], 16, &source) ||
+	    !parse_int(argv[2], 16, &dest) ||
+	    !parse_int(argv[3], 0, &size) ||
+	    dest >= flash_info.size || size > flash_info.size - dest) {
+		puts("Usage error");
+		return;
+	}
+	if (!flash_check_erase())
+		return;
+
+	done = flash_write(source, dest, size, &stats);
+#ifndef BOOT1
+	shadow_invalidate(dest, size);
+#endif
+	if (done)
+		flash_stats_show(&stats);
+}
+
+#ifndef BOOT1
+/* Hash RAM (hash) or flash (flhs) contents, to check them without reading them back */
+static void cmd_hash(int argc, char **argv)
+{
+	uint32_t addr, size, crc = 0;
+	bool flash = argv[0][0] == 'f';
+	bool sha;
+	uint8_t buf[256];
+	const uint8_t *data = buf;
+	struct sha256 sha256;
+
+	if (argc != 4 ||
+	    !parse_int(argv[2], 16, &addr) ||
+	    !parse_int(argv[3], 0, &size)) {
+		puts("Usage error");
+		return;
+	}
+
+	sha = !strncmp(argv[1], "sha", 4);
+	sha256_init(&sha256);
+	if (!sha && strncmp(argv[1], "crc", 4)) {
+		puts("Unknown hash");
+		return;
+	}
+
+	for (uint32_t pos = 0; pos < size; pos += sizeof(buf)) {
+		size_t chunk = min(sizeof(buf), size - pos);
+
+		if (flash)
+			flash_read(addr + pos, buf, chunk);
+		else
+			data = (const uint8_t *)(addr + pos);
+
+		if (sha)
+			sha256_update(&sha256, data, chunk);
+		else
+			crc = crc32_update(crc, data, chunk);
+
+		if (pos % (4 * KiB) == 0)
+			uart_poll();
+	}
+
+	if (sha) {
+		sha256_final(&sha256, buf);
+		for (int i = 0; i < 32; i++)
+			put_hex8(buf[i]);
+		putchar('\n');
+		return;
+	}
+
+	put_hex32(crc);
+	putchar('\n');
+}
+
+/* Show or set the flash read command and SPI0 clock */
+static void cmd_flcf(int argc, char **argv)
+{
+	uint32_t mux;
+
+	if (argc >= 2) {
+		if (!strncmp(argv[1], "fast", 5)) {
+			flash_read_cmd = FLASH_FAST_READ;
+		} else if (!strncmp(argv[1], "read", 5)) {
+			flash_read_cmd = FLASH_READ;
+		} else {
+			puts("Usage error");
+			return;
+		}
+	}
+
+	if (argc >= 3) {
+		if (!parse_int(argv[2], 0, &mux) || mux > CLK_SPI0_MUX_MASK) {
+			puts("Usage error");
+			return;
+		}
+		write32(CLK_SPI0_MUX, (read32(CLK_SPI0_MUX) & ~CLK_SPI0_MUX_MASK) | mux);
+	}
+
+	putstr("Read command ");
+	put_hex8(flash_read_cmd);
+	putstr(", SPI0 clock mux ");
+	put_dec(read32(CLK_SPI0_MUX) & CLK_SPI0_MUX_MASK);
+	putchar('\n');
+}
+
+/* Probe the flash again, and show what is known about it */
+static void cmd_flid(int argc, char **argv)
+{
+	static const char *const sizes[] = { "4K", "32K", "64K" };
+
+	(void)argc;
+	(void)argv;
+	flash_probe();
+
+	putstr("JEDEC ID ");
+	for (int i = 0; i < 3; i++)
+		put_hex8(flash_info.id[i]);
+	putstr(", ");
+	put_dec(flash_info.size / KiB);
+	putstr(" KiB, page ");
+	put_dec(flash_info.page);
+	putstr(", ");
+	put_dec(flash_info.addr_len);
+	puts("-byte addresses");
+
+	for (int i = 0; i < ERASE_TYPES; i++) {
+		if (!flash_info.erase_op[i])
+			continue;
+		putstr("Erase ");
+		putstr(sizes[i]);
+		putstr(": ");
+		put_hex8(flash_info.erase_op[i]);
+		if (flash_info.erase_ms[i]) {
+			putstr(", typically ");
+			put_dec(flash_info.erase_ms[i]);
+			putstr(" ms");
+		}
+		putchar('\n');
+	}
+}
+
+/* Measure the flash read throughput */
+static void cmd_flbm(int argc, char **argv)
+{
+	uint32_t addr, size, start;
+	uint8_t buf[1024];
+
+	if (argc != 3 ||
+	    !parse_int(argv[1], 16, &addr) ||
+	    !parse_int(argv[2], 0, &size)) {
+		puts("Usage error");
+		return;
+	}
+
+	start = timer_get();
+	for (uint32_t pos = 0; pos < size; pos += sizeof(buf))
+		flash_read(addr + pos, buf, min(sizeof(buf), size - pos));
+	put_rate(size, timer_get() - start);
+}
+
+/*
+ * Measure the RAM throughput and latency through kseg0 (cached) and kseg1
+ * (uncached), for working sets from 1 KiB up to a maximum size. Small sets are
+ * measured over at least 1 MiB, after a pass that warms up the cache. Copies
+ * go from the first to the second half of the set, and fills allocate cache
+ * lines without reading them. The latency is that of a chain of dependent
+ * loads, MBM_STRIDE bytes apart. The contents of the memory are lost.
+ */
+#define MBM_STRIDE	256
+#define MBM_LOADS	0x10000
+
+enum { MBM_READ, MBM_WRITE, MBM_COPY, MBM_FILL, MBM_TESTS };
+
+static uint32_t mbm_pass(int test, uint32_t addr, uint32_t size)
+{
+	uint32_t start = timer_get(), end = addr + size;
+
+	switch (test) {
+	case MBM_READ:
+		for (; addr < end; addr += 4)
+			read32(addr);
+		break;
+	case MBM_WRITE:
+		for (; addr < end; addr += 4)
+			write32(addr, addr);
+		break;
+	case MBM_COPY:
+		memcpy_fast(addr + size / 2, addr, size / 2);
+		break;
+	case MBM_FILL:
+		for (; addr < end; addr += CACHE_LINE) {
+			pref(PREF_PREPARE_FOR_STORE, addr);
+			for (int i = 0; i < CACHE_LINE; i += 4)
+				write32(addr + i, 0);
+		}
+		break;
+	}
+
+	return timer_get() - start;
+}
+
+static void cmd_mbm(int argc, char **argv)
+{
+	uint32_t addr = 0x80100000, max_size = 32 * MiB;
+
+	/* The sizes are powers of two, which the pointer chain relies on */
+	if (argc > 3 ||
+	    (argc > 1 && !parse_int(argv[1], 16, &addr)) ||
+	    (argc > 2 && !parse_int(argv[2], 0, &max_size)) ||
+	    (addr & 0x1fffffff) >= (SCRATCH_LOW & 0x1fffffff) ||
+	    max_size > (SCRATCH_LOW & 0x1fffffff) - (addr & 0x1fffffff)) {
+		puts("Usage error");
+		return;
+	}
+
+	puts("Size Segment Read Write Copy Fill (MB/s) Latency (ns)");
+	for (int seg = 0; seg < 2; seg++) {
+		uint32_t base = (addr & 0x1fffffff) | (seg? 0xa0000000 : 0x80000000);
+
+		cache_flush_range(addr, max_size);
+		for (uint32_t size = KiB; size <= max_size; size *= 2) {
+			uint32_t reps = max(MiB / size, 1), ticks, rate, p;
+
+			put_dec(size);
+			putstr(seg? " kseg1" : " kseg0");
+			for (int test = 0; test < MBM_TESTS; test++) {
+				uint32_t bytes = (test == MBM_COPY)? size / 2 : size;
+
+				if (reps > 1)
+					mbm_pass(test, base, size);
+				ticks = 0;
+				for (uint32_t i = 0; i < reps; i++)
+					ticks += mbm_pass(test, base, size);
+
+				rate = rate_kb(bytes * reps, ticks);
+				putchar(' ');
+				put_milli(rate / 1000, rate % 1000);
+			}
+
+			/* Each word points to the one MBM_STRIDE bytes later, wrapping around */
+			for (p = 0; p < size; p += MBM_STRIDE)
+				write32(base + p, base + ((p + MBM_STRIDE) & (size - 1)));
+			p = base;
+			ticks = timer_get();
+			for (int i = 0; i < MBM_LOADS; i++)
+				p = read32(p);
+			ticks = timer_get() - ticks;
+			putchar(' ');
+			put_dec(ticks * 1000 / 3275 * 1000 / MBM_LOADS);
+			putchar('\n');
+
+			if (uart_interrupted())
+				return;
+		}
+	}
+	cache_flush_range(addr, max_size);
+}
+
+/* Compare RAM (cmp) or flash (flcm) against RAM, and print the differing ranges */
+
+#define CMP_GAP		16	/* differences closer than this are shown as one range */
+#define CMP_SHOW	8	/* bytes shown of each range */
+#define CMP_RANGES	32	/* ranges shown at most */
+
+struct cmp_range {
+	uint32_t start, end;
+	uint8_t a[CMP_SHOW], b[CMP_SHOW];
+};
+
+static void cmp_show_bytes(const uint8_t *bytes, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		putchar(' ');
+		put_hex8(bytes[i]);
+	}
+}
+
+static void cmp_show_range(struct cmp_range *r, uint32_t a, uint32_t b)
+{
+	size_t n = min(CMP_SHOW, r->end - r->start);
+
+	put_hex32(a + r->start);
+	putchar(' ');
+	put_hex32(b + r->start);
+	putchar(' ');
+	put_hex32(r->end - r->start);
+	putchar(':');
+	cmp_show_bytes(r->a, n);
+	putstr(" |");
+	cmp_show_bytes(r->b, n);
+	putchar('\n');
+}
+
+static void cmd_cmp(int argc, char **argv)
+{
+	uint32_t a, b, size, ranges = 0, bytes = 0;
+	bool flash = argv[0][0] == 'f';
+	struct cmp_range r;
+	uint8_t buf[256];
+	const uint8_t *pa = buf, *pb;
+
+	if (argc != 4 ||
+	    !parse_int(argv[1], 16, &a) ||
+	    !parse_int(argv[2], 16, &b) ||
+	    !parse_int(argv[3], 0, &size)) {
+		puts("Usage error");
+		return;
+	}
+
+	for (uint32_t pos = 0; pos < size; pos += sizeof(buf)) {
+		size_t chunk = min(sizeof(buf), size - pos);
+
+		if (flash)
+			flash_read(a + pos, buf, chunk);
+		else
+			pa = (const uint8_t *)(a + pos);
+		pb = (const uint8_t *)(b + pos);
+
+		for (size_t i = 0; i < chunk; i++) {
+			uint32_t offset = pos + i;
+
+			if (ranges && offset - r.start < CMP_SHOW) {
+				r.a[offset - r.start] = pa[i];
+				r.b[offset - r.start] = pb[i];
+			}
+
+			if (pa[i] == pb[i])
+				continue;
+
+			bytes++;
+			if (ranges && offset - r.end < CMP_GAP) {
+				r.end = offset + 1;
+				continue;
+			}
+
+			if (ranges && ranges <= CMP_RANGES)
+				cmp_show_range(&r, a, b);
+			ranges++;
+			r.start = offset;
+			r.end = offset + 1;
+			r.a[0] = pa[i];
+			r.b[0] = pb[i];
+		}
+
+		if (pos % (4 * KiB) == 0)
+			uart_poll();
+	}
+
+	if (ranges == 0) {
+		puts("Identical");
+		return;
+	}
+
+	if (ranges <= CMP_RANGES)
+		cmp_show_range(&r, a, b);
+	else
+		puts("...");
+	put_hex32(ranges);
+	putstr(" ranges, ");
+	put_hex32(bytes);
+	puts(" bytes differ");
+}
+
+/* Read (shrd) or write (shwr) the flash shadow */
+static void cmd_shadow(int argc, char **argv)
+{
+	bool write = argv[0][2] == 'w';
+	uint32_t source, dest, size, flash, ram, chunk;
+
+	if (argc != 4 ||
+	    !parse_int(argv[1], 16, &source) ||
+	    !parse_int(argv[2], 16, &dest) ||
+	    !parse_int(argv[3], 0, &size)) {
+		puts("Usage error");
+		return;
+	}
+
+	flash = write? dest : source;
+	ram = write? source : dest;
+	if (flash >= min(SHADOW_SIZE, flash_info.size) ||
+	    size > min(SHADOW_SIZE, flash_info.size) - flash) {
+		puts("Usage error");
+		return;
+	}
+
+	for (uint32_t pos = 0; pos < size; pos += chunk) {
+		uint32_t sector = (flash + pos) / FLASH_SECTOR;
+		uint32_t offset = (flash + pos) % FLASH_SECTOR;
+		uint8_t *p;
+
+		chunk = min(FLASH_SECTOR - offset, size - pos);
+
+		/* A sector that is overwritten completely doesn't have to be read first */
+		p = shadow_sector(sector, !write || chunk != FLASH_SECTOR) + offset;
+		if (write) {
+			memcpy_fast((uint32_t)p, ram + pos, chunk);
+			shadow_set(shadow_dirty, sector, true);
+		} else {
+			memcpy_fast(ram + pos, (uint32_t)p, chunk);
+		}
+		uart_poll();
+	}
+}
+
+/* Write the dirty sectors of the shadow (or of a range of it) back to flash */
+static void cmd_shcm(int argc, char **argv)
+{
+	uint32_t addr = 0, size = SHADOW_SIZE, first, last;
+	struct flash_stats stats = { 0 };
+
+	if ((argc != 1 && argc != 3) ||
+	    (argc == 3 && (!parse_int(argv[1], 16, &addr) ||
+			   !parse_int(argv[2], 0, &size))) ||
+	    addr >= SHADOW_SIZE || size > SHADOW_SIZE - addr) {
+		puts("Usage error");
+		return;
+	}
+	if (!flash_check_erase())
+		return;
+
+	first = addr / FLASH_SECTOR;
+	last = (addr + size + FLASH_SECTOR - 1) / FLASH_SECTOR;
+
+	/* Write runs of dirty sectors at once, so that block erases can be used */
+	for (uint32_t sector = first; sector < last; sector++) {
+		uint32_t end = sector;
+
+		while (end < last && shadow_test(shadow_dirty, end)) {
+			shadow_set(shadow_dirty, end, false);
+			end++;
+		}
+		if (end == sector)
+			continue;
+
+		if (!flash_write(SCRATCH_SHADOW + sector * FLASH_SECTOR, sector * FLASH_SECTOR,
+				 (end - sector) * FLASH_SECTOR, &stats)) {
+			/* Keep the run dirty, so that shcm can be retried */
+			while (end-- > sector)
+				shadow_set(shadow_dirty, end, true);
+			return;
+		}
+		sector = end;
+	}
+
+	flash_stats_show(&stats);
+}
+
+/* Show the dirty ranges of the shadow, or drop the shadow including any changes */
+static void cmd_shst(int argc, char **argv)
+{
+	uint32_t loaded = 0, dirty = 0;
+
+	if (argc == 2 && !strncmp(argv[1], "drop", 5)) {
+		memset(shadow_loaded, 0, sizeof(shadow_loaded));
+		memset(shadow_dirty, 0, sizeof(shadow_dirty));
+		return;
+	} else if (argc != 1) {
+		puts("Usage error");
+		return;
+	}
+
+	for (uint32_t sector = 0; sector < SHADOW_SECTORS; sector++) {
+		uint32_t end = sector;
+
+		loaded += shadow_test(shadow_loaded, sector);
+		while (end < SHADOW_SECTORS && shadow_test(shadow_dirty, end))
+			end++;
+		if (end == sector)
+			continue;
+
+		/* Count the rest of the dirty run, which is loaded by definition */
+		loaded += end - sector - 1;
+		dirty += end - sector;
+		put_hex32(sector * FLASH_SECTOR);
+		putchar(' ');
+		put_hex32((end - sector) * FLASH_SECTOR);
+		puts(" dirty");
+		sector = end - 1;
+	}
+
+	put_dec(loaded);
+	putstr(" sectors loaded, ");
+	put_dec(dirty);
+	puts(" dirty");
+}
+
+/*
+ * Receive data in binary frames and write it to flash: Sectors are erased
+ * ahead of the data, and each page is programmed as soon as it has arrived,
+ * so that the transfer, the erases and the programming overlap. The flash is
+ * not compared first, and the rest of the last sector ends up erased.
+ */
+#define FLST_AHEAD	(64 * KiB)	/* how far ahead of the data to erase */
+
+static void cmd_flst(int argc, char **argv)
+{
+	struct frame_stream fs;
+	uint32_t dest, size, end, prog, erased, fill = 0, pages = 0;
+	uint32_t erase_start = 0, erase_ms = 0;	/* of the running erase, if any */
+	uint8_t page[FLASH_PAGE_MAX];
+
+	if (argc != 3 ||
+	    !parse_int(argv[1], 16, &dest) ||
+	    !parse_int(argv[2], 0, &size) ||
+	    dest % FLASH_SECTOR || dest >= flash_info.size || size > flash_info.size - dest) {
+		puts("Usage error");
+		return;
+	}
+	if (!flash_check_erase())
+		return;
+
+	end = dest + size;
+	prog = erased = dest;
+	shadow_invalidate(dest, size);
+	uart_flow_pause(true);
+	fstream_begin(&fs, size);
+
+	while (prog < end) {
+		uint32_t len = min(flash_info.page - prog % flash_info.page, end - prog);
+
+		/* Take whatever has arrived for the current page */
+		fstream_poll(&fs);
+		while (fill < len && fs.full[fs.cur])
+			page[fill++] = fstream_getc(&fs);
+
+		if (flash_busy()) {
+			if (erase_ms && check_timeout(erase_start, erase_ms)) {
+				fstream_abort(&fs);
+				puts("Flash erase timeout");
+				return;
+			}
+			continue;
+		}
+		erase_ms = 0;
+
+		if (fill == len && prog < erased) {
+			bool blank = true;
+
+			for (uint32_t i = 0; i < len; i++)
+				blank &= page[i] == 0xff;
+			if (!blank) {
+				flash_program_start(prog, page, len);
+				pages++;
+			}
+			prog += len;
+			fill = 0;
+		} else if (erased < end && erased < prog + FLST_AHEAD) {
+			static const uint32_t sizes[] = { 4 * KiB, 32 * KiB, 64 * KiB };
+			int type = ERASE_64K;
+
+			/* Use the largest erase that fits */
+			while (type > ERASE_4K &&
+			       (!flash_info.erase_op[type] || erased % sizes[type] ||
+				end - erased < sizes[type]))
+				type--;
+			flash_erase_start(flash_info.erase_op[type], erased);
+			erase_start = timer_get();
+			erase_ms = flash_erase_timeout(type);
+			erased += sizes[type];
+		} else if (check_timeout(fs.last_rx, FRAME_TIMEOUT_MS)) {
+			fstream_abort(&fs);
+			puts("Timeout");
+			return;
+		}
+	}
+
+	flash_poll_wip();
+	fstream_finish(&fs);
+
+	put_dec((erased - dest) / FLASH_SECTOR);
+	putstr(" sectors erased, ");
+	put_dec(pages);
+	puts(" pages programmed");
+}
+#endif /* BOOT1 */
+
+#ifndef BOOT1
+/*
+ * Run an I2C transaction: Write the given bytes to the device, then read
+ * count bytes after a repeated start, and stop. The read bytes are printed,
+ * followed by the status, or stop early with an error.
+ */
+static void cmd_i2c(int argc, char **argv)
+{
+	uint32_t bus, addr, base, value, count = 0, nread = 0;
+	uint8_t data[16];
+	int nwrite = 0, status = 0;
+
+	if (argc < 3 ||
+	    !parse_int(argv[1], 0, &bus) || bus >= ARRAY_LENGTH(i2c_bases) ||
+	    !parse_int(argv[2], 16, &addr) || addr > 0x7f) {
+		puts("Usage error");
+		return;
+	}
+
+	for (int i = 3; i < argc; i++) {
+		if (!strncmp(argv[i], "rd", 3)) {
+			if (i != argc - 2 || !parse_int(argv[i + 1], 0, &count) || count > sizeof(data)) {
+				puts("Usage error");
+				return;
+			}
+			break;
+		}
+		if (!parse_int(argv[i], 16, &value) || value > 0xff) {
+			puts("Usage error");
+			return;
+		}
+		data[nwrite++] = value;
+	}
+
+	base = i2c_bases[bus];
+	if (nwrite || !count) {
+		status = i2c_write(base, addr << 1, true);
+		for (int i = 0; i < nwrite && status >= 0 && !(status & I2C_STATUS_ERROR); i++)
+			status = i2c_write(base, data[i], false);
+	}
+
+	if (count && status >= 0 && !(status & I2C_STATUS_ERROR)) {
+		status = i2c_write(base, addr << 1 | 1, true);
+		for (; nread < count && status >= 0 && !(status & I2C_STATUS_ERROR); nread++) {
+			status = i2c_read(base, &data[nread], nread == count - 1);
+			if (nread)
+				putchar(' ');
+			put_hex8(data[nread]);
+		}
+		if (nread)
+			putchar('\n');
+	}
+
+	if (status >= 0)
+		status |= i2c_stop(base);
+
+	if (status < 0) {
+		puts("Timeout");
+		return;
+	}
+
+	if (status & I2C_STATUS_ERROR)
+		putstr("Error, ");
+	putstr("status ");
+	put_hex8(status);
+	putchar('\n');
+}
+
+static const uint32_t spi_bases[] = { SPI0_BASE, SPI1_BASE };
+
+/*
+ * Run an SPI transaction: Send the command bytes, and then either send size
+ * bytes from memory, or receive size bytes to memory, or print them if no
+ * address is given.
+ */
+static void cmd_spi(int argc, char **argv)
+{
+	uint32_t bus, value, addr = 0, txlen = 0, rxlen = 0;
+	const uint8_t *txbuf = NULL;
+	uint8_t cmd[SPI_CMD_MAX], data[16];
+	int ncmd = 0, i;
+
+	if (argc < 3 || !parse_int(argv[1], 0, &bus) || bus >= ARRAY_LENGTH(spi_bases)) {
+		puts("Usage error");
+		return;
+	}
+
+	for (i = 2; i < argc && strncmp(argv[i], "wr", 3) && strncmp(argv[i], "rd", 3); i++) {
+		if (ncmd == SPI_CMD_MAX || !parse_int(argv[i], 16, &value) || value > 0xff) {
+			puts("Usage error");
+			return;
+		}
+		cmd[ncmd++] = value;
+	}
+
+	if (i < argc) {
+		bool rd = argv[i][0] == 'r';
+
+		if (argc - i != 2 + !rd && argc - i != 3) {
+			puts("Usage error");
+			return;
+		}
+		if (rd) {
+			if (!parse_int(argv[i + 1], 0, &rxlen) ||
+			    (argc - i == 3 && !parse_int(argv[i + 2], 16, &addr)) ||
+			    (!addr && rxlen > sizeof(data))) {
+				puts("Usage error");
+				return;
+			}
+		} else {
+			if (!parse_int(argv[i + 1], 16, &addr) || !parse_int(argv[i + 2], 0, &txlen)) {
+				puts("Usage error");
+				return;
+			}
+			txbuf = (const uint8_t *)addr;
+		}
+	}
+
+	spi_transfer_on(spi_bases[bus], cmd, ncmd, txbuf, txlen,
+			addr? (uint8_t *)addr : data, rxlen);
+
+	if (rxlen && !addr) {
+		for (i = 0; i < (int)rxlen; i++) {
+			if (i)
+				putchar(' ');
+			put_hex8(data[i]);
+		}
+		putchar('\n');
+	}
+}
+#endif /* BOOT1 */
+
+static void cmd_flow(int argc, char **argv)
+{
+	if (argc == 2 && !strncmp(argv[1], "on", 3)) {
+		uart_flow_enabled = true;
+	} else if (argc == 2 && !strncmp(argv[1], "off", 4)) {
+		uart_flow_send(false);
+		uart_flow_enabled = false;
+	} else if (argc != 1) {
+		puts("Usage error");
+		return;
+	}
+
+	putstr("XON/XOFF flow control ");
+	putstr(uart_flow_enabled? "on" : "off");
+	putstr(", dropped characters: ");
+	put_hex32(uart_dropped);
+	putchar('\n');
+}
+
+#ifndef BOOT1
+/* Baud rate switching */
+
+#define BAUD_PATTERN_LEN 64
+
+static uint8_t baud_pattern(int i)
+{
+	return i * 0x3b + 0x5a;
+}
+
+/* Wait until all output has left the UART */
+static void uart_tx_flush(void)
+{
+	uint32_t start;
+
+	while (uart_tx_level() != 0)
+		;
+
+	/* ... including the last character in the shift register */
+	start = timer_get();
+	while (!check_timeout(start, 2))
+		;
+}
+
+/* Wait for the host to send "BAUD", ignoring any garbage before it */
+static bool baud_wait_sync(uint32_t ms)
+{
+	static const char sync[] = "BAUD";
+	uint32_t start = timer_get();
+	size_t matched = 0;
 
-	/* A description of the function */
-	const char *description;
+	while (matched < 4) {
+		if (check_timeout(start, ms))
+			return false;
+		if (uart_rx_level() == 0)
+			continue;
+
+		char c = uart_rx();
+		if (c == sync[matched])
+			matched++;
+		else
+			matched = (c == sync[0]);
+	}
 
-	/* The implementation */
-	void (*function)(int argc, char **argv);
-};
+	return true;
+}
 
-static void cmd_echo(int argc, char **argv)
+/*
+ * The host sends "BAUD" and a test pattern at the new baud rate, lolmon sends
+ * the pattern back, and the host confirms with another "BAUD".
+ */
+static bool baud_handshake(void)
 {
-	for (int i = 1; i < argc; i++) {
-		putstr(argv[i]);
-		putchar(' ');
-	}
-	putchar('\n');
+	if (!baud_wait_sync(2000))
+		return false;
+
+	for (int i = 0; i < BAUD_PATTERN_LEN; i++)
+		if (getchar_timeout(100) != baud_pattern(i))
+			return false;
+
+	for (int i = 0; i < BAUD_PATTERN_LEN; i++)
+		uart_tx(baud_pattern(i));
+
+	return baud_wait_sync(1000);
 }
 
-static void cmd_read(int argc, char **argv)
+static void cmd_baud(int argc, char **argv)
 {
-	size_t elems_per_line, increment, elems, addr, pos = 0;
-	char op = argv[0][1];
+	uint32_t baud, rate, div, frac, actual, old_div, old_frac;
 
-	switch (argc) {
-	case 2:
-		elems = 1;
-		break;
-	case 3:
-		if (!parse_int(argv[2], 0, &elems))
-			return;
-		break;
-	default:
+	if (argc != 2 || !parse_int(argv[1], 0, &baud) || baud == 0) {
 		puts("Usage error");
 		return;
 	}
 
-	switch (op) {
-	case 'b':
-		elems_per_line = 16;
-		increment = 1;
-		break;
-	case 'h':
-		elems_per_line = 16;
-		increment = 2;
-		break;
-	case 'w':
-		elems_per_line = 8;
-		increment = 4;
-		break;
-	default:
+	/* The UART samples at 16x the baud rate, with a fractional divider in 1/16 steps */
+	rate = clk_rate_slow();
+	div = rate / (baud * 16);
+	frac = rate % (baud * 16) / baud;
+	actual = rate / (div * 16 + frac);
+	if (div == 0 || div > 255 || max(actual, baud) - min(actual, baud) > baud / 32) {
+		puts("Unsupported baud rate");
 		return;
 	}
 
-	if (!parse_int(argv[1], 16, &addr))
+	puts("Switching baud rate");
+	uart_flow_pause(true);
+	uart_tx_flush();
+
+	old_div = read32(UART_BAUD_DIV);
+	old_frac = read32(UART_BAUD_FRAC);
+	write32(UART_BAUD_DIV, div);
+	write32(UART_BAUD_FRAC, frac);
+
+	if (baud_handshake())
 		return;
 
-	for (size_t i = 0; i < elems; i++) {
-		uint32_t value;
+	uart_tx_flush();
+	write32(UART_BAUD_DIV, old_div);
+	write32(UART_BAUD_FRAC, old_frac);
+	puts("Handshake failed, keeping the old baud rate");
+}
+#endif /* BOOT1 */
 
-		/* Beginning of the line */
-		if (pos == 0) {
-			if (i)
-				putchar('\n');
-			put_hex32(addr);
-			putstr(": ");
-		} else {
-			putchar(' ');
-		}
+#ifndef BOOT1
+/*
+ * Scripting: Variables can be set and loaded from memory, and used in
+ * expressions in any numeric argument. if, loop and rep run the rest of the
+ * line as their body; loops stop on Ctrl-C.
+ */
 
-		switch (op) {
-		case 'b':
-			value = read8(addr);
-			put_hex8(value);
-			break;
-		case 'h':
-			value = read16(addr);
-			put_hex16(value);
-			break;
-		case 'w':
-			value = read32(addr);
-			put_hex32(value);
-			break;
-		}
+/* The commands after the current one on the line */
+static char *line_rest;
 
-		addr += increment;
-		if (++pos == elems_per_line)
-			pos = 0;
-	}
+static void execute_line(char *line);
 
-	putchar('\n');
+/* Take the rest of the line as the body of if/loop/rep */
+static const char *take_body(void)
+{
+	const char *body = line_rest;
+
+	line_rest += strlen(line_rest);
+	return body;
 }
 
-static void cmd_write(int argc, char **argv)
+/* Run the body once. It is copied, because execute_line modifies the line. */
+static void run_body(const char *body)
 {
-	size_t increment, addr;
-	char op = argv[0][1];
+	char line[128];
 
-	if (argc < 3) {
-		puts("Usage error");
-		return;
+	memcpy(line, body, strlen(body) + 1);
+	execute_line(line);
+}
+
+static bool parse_var(const char *s, uint32_t **var)
+{
+	if (s[0] < 'a' || s[0] > 'z' || s[1]) {
+		putstr("Invalid variable ");
+		puts(s);
+		return false;
 	}
 
-	switch (op) {
-	case 'b':
-		increment = 1;
-		break;
-	case 'h':
-		increment = 2;
-		break;
-	case 'w':
-		increment = 4;
-		break;
-	default:
+	*var = &vars[s[0] - 'a'];
+	return true;
+}
+
+static void cmd_set(int argc, char **argv)
+{
+	uint32_t *var;
+
+	if (argc == 1) {
+		for (int i = 0; i < 26; i++) {
+			if (vars[i]) {
+				putchar('a' + i);
+				putstr(" = ");
+				put_hex32(vars[i]);
+				putchar('\n');
+			}
+		}
 		return;
 	}
 
-	if (!parse_int(argv[1], 16, &addr))
+	if ((argc != 2 && argc != 3) ||
+	    !parse_var(argv[1], &var) ||
+	    (argc == 3 && !parse_int(argv[2], 0, var))) {
+		puts("Usage error");
 		return;
+	}
 
-	for (int i = 2; i < argc; i++) {
-		uint32_t value;
+	if (argc == 2) {
+		put_hex32(*var);
+		putchar('\n');
+	}
+}
 
-		if (!parse_int(argv[i], 0, &value))
-			return;
+/* Load a byte (lb), half-word (lh), or word (lw) into a variable */
+static void cmd_load(int argc, char **argv)
+{
+	uint32_t *var, addr;
 
-		switch (op) {
-		case 'b':
-			write8(addr, value);
-			break;
-		case 'h':
-			write16(addr, value);
-			break;
-		case 'w':
-			write32(addr, value);
-			break;
-		}
+	if (argc != 3 ||
+	    !parse_var(argv[1], &var) ||
+	    !parse_int(argv[2], 16, &addr)) {
+		puts("Usage error");
+		return;
+	}
 
-		addr += increment;
+	switch (argv[0][1]) {
+	case 'b': *var = read8(addr); break;
+	case 'h': *var = read16(addr); break;
+	default: *var = read32(addr); break;
 	}
 }
 
-static void cmd_copy(int argc, char **argv)
+static void cmd_if(int argc, char **argv)
 {
-	size_t increment, src, dest, count;
-	char op = argv[0][1];
+	const char *body = take_body();
+	uint32_t cond;
 
-	if (argc < 3) {
+	if (argc != 2) {
 		puts("Usage error");
 		return;
 	}
 
-	switch (op) {
-	case 'b':
-		increment = 1;
-		break;
-	case 'h':
-		increment = 2;
-		break;
-	case 'w':
-		increment = 4;
-		break;
-	default:
+	if (parse_int(argv[1], 0, &cond) && cond)
+		run_body(body);
+}
+
+static void cmd_loop(int argc, char **argv)
+{
+	const char *body = take_body();
+	uint32_t cond;
+
+	if (argc != 2) {
+		puts("Usage error");
 		return;
 	}
 
-	if (!parse_int(argv[1], 16, &src))
-		return;
-	if (!parse_int(argv[2], 16, &dest))
-		return;
-	if (!parse_int(argv[3], 0, &count))
+	while (parse_int(argv[1], 0, &cond) && cond) {
+		run_body(body);
+		if (uart_interrupted())
+			break;
+	}
+}
+
+static void cmd_rep(int argc, char **argv)
+{
+	const char *body = take_body();
+	uint32_t count, *var = NULL;
+
+	if (argc != 2 && argc != 3) {
+		puts("Usage error");
 		return;
+	}
 
-	for (size_t i = 0; i < count; i++) {
-		uint32_t value;
+	if (!parse_int(argv[1], 0, &count) || (argc == 3 && !parse_var(argv[2], &var)))
+		return;
 
-		switch (op) {
-		case 'b':
-			value = read8(src);
-			write8(dest, value);
+	for (uint32_t i = 0; i < count; i++) {
+		if (var)
+			*var = i;
+		run_body(body);
+		if (uart_interrupted())
 			break;
-		case 'h':
-			value = read16(src);
-			write16(dest, value);
-			break;
-		case 'w':
-			value = read32(src);
-			write32(dest, value);
-			break;
-		}
-
-		src  += increment;
-		dest += increment;
 	}
 }
+#endif /* BOOT1 */
+
+#ifndef BOOT1
+/*
+ * Timing: time runs a command and prints how long it took, by the timer and
+ * by the CP0 Count register (which counts every other CPU cycle). perf counts
+ * two events of the 24K performance counters while a command runs, and prof
+ * samples the PC with the timer interrupt. With "stat on", source() records
+ * how long each line of a script takes.
+ */
+
+#define TRACE_MAX	1024
+#define TRACE_LINE	32	/* characters kept of each line, with the NUL */
+
+/* A copy of the line, since the script may be gone by the time stat runs */
+struct trace_entry {
+	uint32_t ticks;
+	char line[TRACE_LINE];
+};
 
-#define CACHE_LINE 32
-#define CACHE_LINE_MASK (CACHE_LINE - 1)
+static struct trace_entry *const trace = (void *)SCRATCH_TRACE;
+static uint32_t trace_count;
+static bool trace_enabled;
 
-extern char synci_line[1];
-static void (* synci_line_p)(unsigned long p) = (void *)synci_line;
-static void cache_flush_range(unsigned long addr, size_t len)
+static void trace_record(const char *line, uint32_t ticks)
 {
-	for (unsigned long p = addr & ~CACHE_LINE_MASK; p < addr + len; p += CACHE_LINE)
-		synci_line_p(p);
+	if (trace_enabled && trace_count < TRACE_MAX) {
+		struct trace_entry *t = &trace[trace_count++];
+		int i;
+
+		for (i = 0; i < TRACE_LINE - 1 && line[i] && line[i] != '\n' && line[i] != '\r'; i++)
+			t->line[i] = line[i];
+		t->line[i] = 0;
+		t->ticks = ticks;
+	}
 }
 
-static void cmd_sync(int argc, char **argv)
+/* Print a number of timer ticks in milliseconds */
+static void put_ms(uint32_t ticks)
 {
-	(void)argc;
-	(void)argv;
-	cache_flush_range(0x80000000, 64 * MiB);
+	put_milli(ticks / 3275, ticks % 3275 * 1000 / 3275);
+	putstr(" ms");
 }
 
-/* MIPS relocations are weird... */
-extern char do_call[1];
-static void (* do_call_p)(uint32_t fn, uint32_t a1, uint32_t a2, uint32_t a3) = (void *)do_call;
-static void cmd_call(int argc, char **argv)
+static const struct command *find_command(const char *name);
+static void cmd_time(int argc, char **argv)
 {
-	uint32_t fn, args[3];
-	int i;
+	const struct command *cmd;
+	uint32_t start, count;
 
-	if (argc < 2) {
+	if (argc < 2 || !(cmd = find_command(argv[1]))) {
 		puts("Usage error");
 		return;
 	}
 
-	if (!parse_int(argv[1], 16, &fn))
-		return;
-
-	for (i = 0; i < 3 && 2 + i < argc; i++) {
-		args[i] = 0;
-		if (2 + i < argc)
-			parse_int(argv[2 + i], 0, &args[i]);
-	}
-
-	cache_flush_range(0x80000000, 64 * MiB);
+	start = timer_get();
+	count = mfc0(9, 0);
+	cmd->function(argc - 1, argv + 1);
+	count = mfc0(9, 0) - count;
+	start = timer_get() - start;
 
-	do_call_p(fn, args[0], args[1], args[2]);
+	putstr("Time: ");
+	put_ms(start);
+	putstr(", Count ");
+	put_dec(count);
+	putchar('\n');
 }
 
-static void source(const char *script);
-static void cmd_src(int argc, char **argv)
+/* CP0 register 25: Control0, Counter0, Control1, Counter1 are selects 0 to 3 */
+#define PERF_CONTROL_EVENT_SHIFT 5
+#define PERF_CONTROL_EVENT_MAX	0x3f
+#define PERF_CONTROL_ALL_MODES	0xf	/* EXL, kernel, supervisor, user */
+#define CONFIG1_PC		BIT(4)	/* performance counters implemented */
+
+static void cmd_perf(int argc, char **argv)
 {
-	uint32_t script;
+	const struct command *cmd;
+	uint32_t event0, event1, count0, count1;
 
-	if (argc != 2) {
+	if (argc < 4 ||
+	    !parse_int(argv[1], 0, &event0) || event0 > PERF_CONTROL_EVENT_MAX ||
+	    !parse_int(argv[2], 0, &event1) || event1 > PERF_CONTROL_EVENT_MAX ||
+	    !(cmd = find_command(argv[3]))) {
 		puts("Usage error");
 		return;
 	}
 
-	if (!parse_int(argv[1], 16, &script))
+	if (!(mfc0(16, 1) & CONFIG1_PC)) {
+		puts("No performance counters");
 		return;
+	}
 
-	source((const char *)script);
+	mtc0(25, 1, 0);
+	mtc0(25, 3, 0);
+	mtc0(25, 0, event0 << PERF_CONTROL_EVENT_SHIFT | PERF_CONTROL_ALL_MODES);
+	mtc0(25, 2, event1 << PERF_CONTROL_EVENT_SHIFT | PERF_CONTROL_ALL_MODES);
+	cmd->function(argc - 3, argv + 3);
+	mtc0(25, 0, 0);
+	mtc0(25, 2, 0);
+	count0 = mfc0(25, 1);
+	count1 = mfc0(25, 3);
+
+	putstr("Counter 0: ");
+	put_dec(count0);
+	putstr(", counter 1: ");
+	put_dec(count1);
+	putchar('\n');
 }
 
-static void cmd_flrd(int argc, char **argv)
+/*
+ * The profiler: While a command runs, the CP0 Compare interrupt fires every
+ * PROFILE_PERIOD Count ticks, and profile_exception (in start.S) counts the
+ * interrupted PC in one of the buckets of the histogram. The layout of
+ * struct profile is known to profile_exception.
+ */
+#define CP0_STATUS_IE	BIT(0)
+#define CP0_STATUS_EXL	BIT(1)
+#define CP0_STATUS_ERL	BIT(2)
+#define CP0_STATUS_IM	0x0000ff00
+#define CP0_STATUS_IM7	BIT(15)		/* the timer interrupt */
+#define CP0_STATUS_BEV	BIT(22)
+#define CP0_CAUSE_IV	BIT(23)
+#define CP0_EBASE_BASE	0xfffff000
+#define EXCEPTION_OFFSET 0x180		/* of the general exception vector, from EBase */
+#define PROFILE_PERIOD	10000
+#define PROFILE_BUCKETS_MAX 0x10000
+
+struct profile {
+	uint32_t base, shift, buckets, period, outside;
+	uint32_t *hist;
+} profile = {
+	.period = PROFILE_PERIOD,
+	.hist = (void *)SCRATCH_PROFILE,
+};
+
+extern char profile_exception[1];
+
+static void cmd_prof(int argc, char **argv)
 {
-	uint32_t source, dest, size;
+	const struct command *cmd;
+	uint32_t base, size, bucket, status, vector, saved[2];
+
+	if (argc == 1) {
+		for (uint32_t i = 0; i < profile.buckets; i++) {
+			if (profile.hist[i]) {
+				put_hex32(profile.base + (i << profile.shift));
+				putstr(": ");
+				put_dec(profile.hist[i]);
+				putchar('\n');
+			}
+		}
+		putstr("Outside: ");
+		put_dec(profile.outside);
+		putchar('\n');
+		return;
+	}
 
-	if (argc != 4 ||
-	    !parse_int(argv[1], 16, &source) ||
-	    !parse_int(argv[2], 16, &dest) ||
-	    !parse_int(argv[3], 0, &size)) {
+	if (argc < 5 ||
+	    !parse_int(argv[1], 16, &base) ||
+	    !parse_int(argv[2], 0, &size) ||
+	    !parse_int(argv[3], 0, &bucket) || bucket < 4 || (bucket & (bucket - 1)) ||
+	    !(cmd = find_command(argv[4]))) {
 		puts("Usage error");
 		return;
 	}
 
-	flash_read(source, (void *)dest, size);
+	/* The vector jumps to profile_exception, so it has to be in the same 256 MiB */
+	vector = (mfc0(15, 1) & CP0_EBASE_BASE) + EXCEPTION_OFFSET;
+	if ((vector ^ (uint32_t)profile_exception) & 0xf0000000) {
+		puts("Unsupported exception base");
+		return;
+	}
+
+	profile.base = base;
+	for (profile.shift = 0; bucket >> profile.shift != 1; profile.shift++)
+		;
+	profile.buckets = min((size + bucket - 1) >> profile.shift, PROFILE_BUCKETS_MAX);
+	profile.outside = 0;
+	memset(profile.hist, 0, profile.buckets * sizeof(uint32_t));
+
+	/* Jump from the general exception vector to profile_exception */
+	saved[0] = read32(vector);
+	saved[1] = read32(vector + 4);
+	write32(vector, 0x08000000 | (((uint32_t)profile_exception >> 2) & 0x03ffffff));
+	write32(vector + 4, 0);	/* nop */
+	cache_flush_range(vector, 8);
+
+	status = mfc0(12, 0);
+	mtc0(13, 0, mfc0(13, 0) & ~CP0_CAUSE_IV);
+	mtc0(11, 0, mfc0(9, 0) + PROFILE_PERIOD);
+	mtc0(12, 0, (status & ~(CP0_STATUS_IM | CP0_STATUS_BEV | CP0_STATUS_ERL | CP0_STATUS_EXL)) |
+		    CP0_STATUS_IM7 | CP0_STATUS_IE);
+
+	cmd->function(argc - 4, argv + 4);
+
+	mtc0(12, 0, status);
+	write32(vector, saved[0]);
+	write32(vector + 4, saved[1]);
+	cache_flush_range(vector, 8);
 }
 
-static void cmd_flwr(int argc, char **argv)
+static void cmd_stat(int argc, char **argv)
 {
-	uint32_t source, dest, size;
+	uint32_t total = 0;
 
-	if (argc != 4 ||
-	    !parse_int(argv[1], 16, &source) ||
-	    !parse_int(argv[2], 16, &dest) ||
-	    !parse_int(argv[3], 0, &size) ||
-	    dest >= 64 * MiB) {
+	if (argc == 2 && !strncmp(argv[1], "on", 3)) {
+		trace_enabled = true;
+		return;
+	} else if (argc == 2 && !strncmp(argv[1], "off", 4)) {
+		trace_enabled = false;
+		return;
+	} else if (argc == 2 && !strncmp(argv[1], "clear", 6)) {
+		trace_count = 0;
+		return;
+	} else if (argc != 1) {
 		puts("Usage error");
 		return;
 	}
 
-	if (dest & 0xfff)
-		puts("Warning: destination is not page aligned");
-
-	/* Erase 4K-sectorwise */
-	for (size_t s = 0; s < size; s += 0x1000) {
-		size_t chunk = min(0x1000, size - s);
-
-		if (flash_page_needs_erase(dest+s, (void *)(source+s), chunk))
-			flash_erase4k(dest+s);
-
-		for (size_t p = 0; p < chunk; p += 256)
-			flash_program_page(dest+s+p, (void *)(source+s+p), min(256, chunk-p));
+	for (uint32_t i = 0; i < trace_count; i++) {
+		put_ms(trace[i].ticks);
+		putstr("  ");
+		puts(trace[i].line);
+		total += trace[i].ticks;
 	}
+	putstr("Total ");
+	put_ms(total);
+	putstr(trace_count == TRACE_MAX? ", table full\n" : "\n");
 }
+#endif /* BOOT1 */
 
 static const char bootscript[] = {
 	#include "bootscript.h"
@@ -711,20 +3837,92 @@ static void cmd_help(int argc, char **argv);
 static const struct command commands[] = {
 	{ "help", "[command]", "Show help output for one or all commands", cmd_help },
 	{ "echo", "[words]", "Echo a few words", cmd_echo },
+#ifndef BOOT1
+	{ "rb", "address [count [stride]]", "Read one or more bytes", cmd_read },
+	{ "rh", "address [count [stride]]", "Read one or more half-words (16-bit)", cmd_read },
+	{ "rw", "address [count [stride]]", "Read one or more words (32-bit)", cmd_read },
+#else
 	{ "rb", "address [count]", "Read one or more bytes", cmd_read },
 	{ "rh", "address [count]", "Read one or more half-words (16-bit)", cmd_read },
 	{ "rw", "address [count]", "Read one or more words (32-bit)", cmd_read },
+#endif
 	{ "wb", "address values", "Write one or more bytes", cmd_write },
 	{ "wh", "address values", "Write one or more half-words (16-bit)", cmd_write },
 	{ "ww", "address values", "Write one or more words (32-bit)", cmd_write },
+	{ "pb", "address mask [!]value [ms]", "Wait for a byte to match a value", cmd_poll },
+	{ "ph", "address mask [!]value [ms]", "Wait for a half-word (16-bit) to match a value", cmd_poll },
+	{ "pw", "address mask [!]value [ms]", "Wait for a word (32-bit) to match a value", cmd_poll },
+#ifndef BOOT1
+	{ "rv", "[b|h|w] address...", "Read a list of addresses", cmd_vector },
+	{ "wv", "[b|h|w] address value...", "Write a list of addresses", cmd_vector },
+	{ "mb", "address mask value", "Masked write to a byte", cmd_modify },
+	{ "mh", "address mask value", "Masked write to a half-word (16-bit)", cmd_modify },
+	{ "mw", "address mask value", "Masked write to a word (32-bit)", cmd_modify },
+	{ "setb", "address bits", "Set bits in a byte", cmd_modify },
+	{ "seth", "address bits", "Set bits in a half-word (16-bit)", cmd_modify },
+	{ "setw", "address bits", "Set bits in a word (32-bit)", cmd_modify },
+	{ "clrb", "address bits", "Clear bits in a byte", cmd_modify },
+	{ "clrh", "address bits", "Clear bits in a half-word (16-bit)", cmd_modify },
+	{ "clrw", "address bits", "Clear bits in a word (32-bit)", cmd_modify },
+#endif
 	{ "cb", "source destination count", "Copy one or more bytes", cmd_copy },
 	{ "ch", "source destination count", "Copy one or more half-words (16-bit)", cmd_copy },
 	{ "cw", "source destination count", "Copy one or more words (32-bit)", cmd_copy },
+#ifndef BOOT1
+	{ "cbm", "source destination count", "Benchmark copying bytes", cmd_cbm },
+	{ "fb", "address value count", "Fill memory with bytes", cmd_fill },
+	{ "fh", "address value count", "Fill memory with half-words (16-bit)", cmd_fill },
+	{ "fw", "address value count", "Fill memory with words (32-bit)", cmd_fill },
+#endif
+	{ "wbin", "address count", "Receive data in binary frames", cmd_wbin },
+	{ "rbin", "address count", "Send data in binary frames", cmd_rbin },
+#ifndef BOOT1
+	{ "unlz", "address count", "Receive LZMA data in binary frames and decompress it", cmd_unlz },
+#endif
 	{ "sync", "", "Synchronize caches", cmd_sync },
-	{ "call", "address [up to 3 args]", "Call a function by address", cmd_call },
+	{ "call", "address [up to 3 args]", "Call a function by address, print the result", cmd_call },
 	{ "src", "address", "Source/run script at address", cmd_src },
 	{ "flrd", "source destination count", "Read from flash", cmd_flrd },
-	{ "flwr", "source destination count", "Write data to flash; destination must be 4k-aligned", cmd_flwr },
+	{ "flwr", "source destination count", "Write data to flash, skipping unchanged sectors", cmd_flwr },
+#ifndef BOOT1
+	{ "flst", "address count", "Receive data in binary frames and write it to flash", cmd_flst },
+	{ "flbt", "name [address]", "Load a kernel from a flash partition and boot it", cmd_flbt },
+#endif
+#ifndef BOOT1
+	{ "hash", "crc|sha address count", "Print the CRC-32 or SHA-256 of memory contents", cmd_hash },
+	{ "flhs", "crc|sha address count", "Print the CRC-32 or SHA-256 of flash contents", cmd_hash },
+	{ "flid", "", "Probe the flash, show its ID and parameters", cmd_flid },
+	{ "flcf", "[read|fast [clock mux]]", "Show or set the flash read command and SPI0 clock", cmd_flcf },
+	{ "flbm", "source count", "Measure the flash read throughput", cmd_flbm },
+	{ "mbm", "[address [max size]]", "Measure the RAM throughput and latency", cmd_mbm },
+	{ "cmp", "address address count", "Compare memory, print differing ranges", cmd_cmp },
+	{ "flcm", "source address count", "Compare flash with memory, print differing ranges", cmd_cmp },
+	{ "shrd", "source destination count", "Read from the flash shadow", cmd_shadow },
+	{ "shwr", "source destination count", "Write data to the flash shadow", cmd_shadow },
+	{ "shcm", "[address count]", "Write the dirty sectors of the flash shadow to flash", cmd_shcm },
+	{ "shst", "[drop]", "Show the dirty sectors of the flash shadow, or drop it", cmd_shst },
+#endif
+#ifndef BOOT1
+	{ "i2c", "bus address [bytes] [rd count]", "Run an I2C transaction", cmd_i2c },
+	{ "spi", "bus bytes [wr address size | rd size [address]]", "Run an SPI transaction", cmd_spi },
+#endif
+	{ "flow", "[on|off]", "Show or set XON/XOFF flow control", cmd_flow },
+#ifndef BOOT1
+	{ "baud", "rate", "Switch to a different baud rate, if the host follows", cmd_baud },
+#endif
+#ifndef BOOT1
+	{ "set", "[variable [value]]", "Set or show variables", cmd_set },
+	{ "lb", "variable address", "Load a byte into a variable", cmd_load },
+	{ "lh", "variable address", "Load a half-word (16-bit) into a variable", cmd_load },
+	{ "lw", "variable address", "Load a word (32-bit) into a variable", cmd_load },
+	{ "if", "expression; commands", "Run the rest of the line if the expression isn't 0", cmd_if },
+	{ "loop", "expression; commands", "Run the rest of the line while the expression isn't 0", cmd_loop },
+	{ "rep", "count [variable]; commands", "Run the rest of the line count times", cmd_rep },
+	{ "time", "command...", "Run a command and print how long it took", cmd_time },
+	{ "perf", "event0 event1 command...", "Count two performance counter events while a command runs", cmd_perf },
+	{ "prof", "[address size bucket command...]", "Sample the PC while a command runs, or show the histogram", cmd_prof },
+	{ "stat", "[on|off|clear]", "Show or record how long each line of a script takes", cmd_stat },
+#endif
 	{ "boot", "", "Continue with the usual boot flow", cmd_boot },
 };
 
@@ -886,21 +4084,36 @@ static void execute_line(char *line)
 	char *argv[16];
 	int argc;
 	const struct command *cmd;
+#ifndef BOOT1
+	/* Nested calls (if/loop/rep, src) must not leave it pointing at their line */
+	char *outer_rest = line_rest;
+#endif
 
 	while (true) {
 		argc = tokenize_line(&line, argv, ARRAY_LENGTH(argv));
 		if (argc == 0)
-			return;
+			break;
 
 		cmd = find_command(argv[0]);
 		if (!cmd) {
 			putstr("Unknown command ");
 			puts(argv[0]);
-			return;
+			break;
 		}
 
+#ifndef BOOT1
+		line_rest = line;
+		cmd->function(argc, argv);
+		line = line_rest;
+#else
 		cmd->function(argc, argv);
+#endif
+		uart_flow_pause(false);
 	}
+
+#ifndef BOOT1
+	line_rest = outer_rest;
+#endif
 }
 
 /* Execute a command script that may be stored in read-only memory,
@@ -916,8 +4129,17 @@ static void source(const char *script)
 		case '\n':
 		case '\r':
 			if (pos < sizeof(line)) {
+#ifndef BOOT1
+				uint32_t start = timer_get();
+
+				line[pos] = 0;
+				execute_line(line);
+				if (pos)
+					trace_record(p - pos, timer_get() - start);
+#else
 				line[pos++] = 0;
 				execute_line(line);
+#endif
 				pos = 0;
 			} else {
 				line[sizeof(line) - 1] = 0;
@@ -955,9 +4177,23 @@ static void main_loop(void)
 	}
 }
 
+extern char _bss_start[];
+extern char _bss_end[];
+char *bss_start_p = _bss_start;
+char *bss_end_p = _bss_end;
+static void bss_init(void)
+{
+	memset(bss_start_p, 0, bss_end_p - bss_start_p);
+}
+
 void main(void)
 {
+	bss_init();
+	cache_init();
 	spi_init();
+#ifndef BOOT1
+	flash_probe();
+#endif
 
 	if (timer_active()) {
 		puts("Press any key to avoid running the default boot script");
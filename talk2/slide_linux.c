@@ -76,13 +76,15 @@ static void spi_transfer(const uint8_t *cmdbuf, size_t cmdlen,
 		;
 }
 
+/* Fast Read: one dummy byte after the address, but works at higher clocks */
 static void flash_read(uint32_t addr, uint8_t *buf, size_t size)
 {
-	uint8_t cmd[4] = {
-		0x03,
+	uint8_t cmd[5] = {
+		0x0b,
 		addr >> 16,
 		addr >> 8,
-		addr
+		addr,
+		0
 	};
 	spi_transfer(cmd, sizeof(cmd), NULL, 0, buf, size);
 }
@@ -32,15 +32,70 @@ static void write32(unsigned long addr, uint32_t value) { *(volatile uint32_t *)
 
 /* Cache manipulation and assembly calls */
 
-#define CACHE_LINE 32
-#define CACHE_LINE_MASK (CACHE_LINE - 1)
+/* Operations for the CACHE instruction */
+#define CACHE_I			0
+#define CACHE_D			1
+#define INDEX_INVALIDATE	(0 << 2)	/* writes back dirty D-cache lines */
+#define HIT_INVALIDATE		(4 << 2)
+#define HIT_WRITEBACK_INV	(5 << 2)	/* D-cache only */
+
+#define cache_op(op, addr) __asm__ volatile("cache %0, 0(%1)" :: "i"(op), "r"(addr))
+
+#define mfc0(reg, sel) ({ uint32_t __value; \
+	__asm__ volatile("mfc0 %0, $" #reg ", " #sel : "=r"(__value)); __value; })
+#define mtc0(reg, sel, value) \
+	__asm__ volatile("mtc0 %0, $" #reg ", " #sel "; ehb" :: "r"((uint32_t)(value)))
+
+/* Size and line size of each cache, from Config1. 0 if absent. */
+static struct cache_info {
+	uint32_t size, line;
+} icache, dcache;
+
+static void cache_info_decode(struct cache_info *cache, uint32_t field)
+{
+	uint32_t sets = (field >> 6) & 7, line = (field >> 3) & 7, ways = field & 7;
+
+	cache->line = line? 2 << line : 0;
+	cache->size = (sets == 7? 32 : 64 << sets) * cache->line * (ways + 1);
+}
+
+static void cache_init(void)
+{
+	uint32_t config1 = mfc0(16, 1);
+
+	cache_info_decode(&icache, config1 >> 16);
+	cache_info_decode(&dcache, config1 >> 7);
+}
 
-extern char synci_line[1];
-static void (* synci_line_p)(unsigned long p) = (void *)synci_line;
+/*
+ * Write back the D-cache and invalidate the I-cache over a range of addresses.
+ * Ranges bigger than a cache are handled with index operations over the whole
+ * cache, which is much faster than going through them line by line.
+ */
 static void cache_flush_range(unsigned long addr, size_t len)
 {
-	for (unsigned long p = addr & ~CACHE_LINE_MASK; p < addr + len; p += CACHE_LINE)
-		synci_line_p(p);
+	unsigned long start, end;
+
+	/* Hit operations need a cached address */
+	addr = (unsigned long)MEM_C(addr);
+	end = addr + len;
+
+	if (len >= dcache.size) {
+		for (start = 0x80000000; start < 0x80000000 + dcache.size; start += dcache.line)
+			cache_op(INDEX_INVALIDATE | CACHE_D, start);
+	} else if (dcache.line) {
+		for (start = addr & -dcache.line; start < end; start += dcache.line)
+			cache_op(HIT_WRITEBACK_INV | CACHE_D, start);
+	}
+	__asm__ volatile("sync");
+
+	if (len >= icache.size) {
+		for (start = 0x80000000; start < 0x80000000 + icache.size; start += icache.line)
+			cache_op(INDEX_INVALIDATE | CACHE_I, start);
+	} else if (icache.line) {
+		for (start = addr & -icache.line; start < end; start += icache.line)
+			cache_op(HIT_INVALIDATE | CACHE_I, start);
+	}
 }
 
 extern char do_call[1];
@@ -159,6 +214,53 @@ static void sleep_ticks(uint32_t ticks)
 }
 
 
+/*
+ * Performance counters: Bracket code with perf_start() and perf_stop() or
+ * perf_print() to count two events of the 24K core, for example 0 (cycles)
+ * and 1 (instructions), as fb_fill and font_draw do with PERF_RENDER. See
+ * the 24K Software User's Manual for the others.
+ * CP0 register 25 holds Control0, Counter0, Control1, Counter1 in selects 0-3.
+ */
+
+#define PERF_CONTROL_EVENT_SHIFT 5
+#define PERF_CONTROL_ALL_MODES	0xf	/* EXL, kernel, supervisor, user */
+#define PERF_EVENT_CYCLES	0
+#define PERF_EVENT_INSNS	1
+
+/* Set to 1 to print cycles and instructions of fb_fill and font_draw */
+#define PERF_RENDER		0
+
+static void perf_start(uint32_t event0, uint32_t event1)
+{
+	mtc0(25, 1, 0);
+	mtc0(25, 3, 0);
+	mtc0(25, 0, event0 << PERF_CONTROL_EVENT_SHIFT | PERF_CONTROL_ALL_MODES);
+	mtc0(25, 2, event1 << PERF_CONTROL_EVENT_SHIFT | PERF_CONTROL_ALL_MODES);
+}
+
+static void perf_stop(uint32_t *count0, uint32_t *count1)
+{
+	mtc0(25, 0, 0);
+	mtc0(25, 2, 0);
+	*count0 = mfc0(25, 1);
+	*count1 = mfc0(25, 3);
+}
+
+/* Stop counting and print the counts, e.g. "fb_fill: 0003d0a4 00024e10" */
+static void perf_print(const char *label)
+{
+	uint32_t count0, count1;
+
+	perf_stop(&count0, &count1);
+	putstr(label);
+	putstr(": ");
+	put_hex32(count0);
+	putchar(' ');
+	put_hex32(count1);
+	putchar('\n');
+}
+
+
 /* I2C/frontpanel driver */
 
 #define I2C_BASE	0xbf158000  /* I2C 2, but we only need that one */
@@ -497,8 +599,14 @@ static void fb_copy(FB fb, FB source)
 
 static void fb_fill(FB fb, color_t color)
 {
+	if (PERF_RENDER)
+		perf_start(PERF_EVENT_CYCLES, PERF_EVENT_INSNS);
+
 	luma_fill(fb.luma, color);
 	chroma_fill(fb.chroma, color);
+
+	if (PERF_RENDER)
+		perf_print("fb_fill");
 }
 
 static void fb_draw_px(FB fb, int x, int y, color_t color)
@@ -696,6 +804,9 @@ static void font_draw(const struct font *font, FB fb, int x_start, int y_start,
 	int x = x_start, y = y_start;
 	int len = 0;
 
+	if (PERF_RENDER)
+		perf_start(PERF_EVENT_CYCLES, PERF_EVENT_INSNS);
+
 	for (const char *p = string; utf8_decode(p, &len); p += len) {
 		if (*p == '\n') {
 			x = x_start;
@@ -705,6 +816,9 @@ static void font_draw(const struct font *font, FB fb, int x_start, int y_start,
 			x += font->norm_space * scale;
 		}
 	}
+
+	if (PERF_RENDER)
+		perf_print("font_draw");
 }
 
 static void font_measure(const struct font *font, int *width, int *height, int scale, const char *string)
@@ -1027,6 +1141,7 @@ int main(void)
 {
 	puts("Launching presentation...");
 	bss_init();
+	cache_init();
 	arena_init();
 	fb_init();
 